@@ -7,7 +7,25 @@
  * 
  *  clang++ -g -O3 Interpreter.cpp Scanner.cpp Parser.cpp `llvm-config --cxxflags`
  * Run:
- *  
+ *      ./interpreter [--perf-map] [--jitdump] [--fast-math=<policy>] < ../input/complexFunc.ka
+ *      ./interpreter --serve=<socket> [--workers=<n>] [--max-batch=<n>]
+ *      ./interpreter --reoptimize[=<calls>] [--profile=<file>] < ../input/complexFunc.ka
+ *
+ * --fast-math sets the floating point policy (strict, contract, reassoc or fast) of every
+ * function without a `def [policy] name(...)` annotation, strict by default.
+ *
+ * Profiling JIT compiled functions with perf:
+ *      --perf-map  writes /tmp/perf-<pid>.map so `perf top -p <pid>` shows function names,
+ *                  of definitions only (top level expressions are freed after running)
+ *      --jitdump   writes a jitdump file for `perf record -k 1` followed by `perf inject --jit`
+ *
+ * --serve keeps running as a server answering requests on a Unix domain socket instead of
+ * reading standard input, see Server.hpp for the protocol.
+ *
+ * --reoptimize compiles definitions with profiling instrumentation first and re-optimizes
+ * them in the background after <calls> calls (10000 by default), see Reoptimizer.hpp.
+ * --profile loads the profiles of an earlier run from <file> and writes them back at the
+ * end of the input, it implies --reoptimize.
  */
 #include <map>
 #include <string>
@@ -17,13 +35,19 @@
 #include <cstdio>
 #include <cstdlib>
 #include <csignal>
+#include <cstring>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/TargetSelect.h>
 
 #include "Parser.hpp"
+#include "Reoptimizer.hpp"
 #include "Scanner.hpp"
+#include "Server.hpp"
 
 using namespace std;
 
+static ExitOnError ExitOnErr;
+
 static void HandleDefinition() {
   std::cout << "Parsing definintion!" << std::endl;
   auto defExpr = parseDefinition();
@@ -31,9 +55,24 @@ static void HandleDefinition() {
     std::cout << "Parsed a function definition." << std::endl;
     defExpr->debugMessage(0);
     std::cout << "LLVM IR:" << std::endl;
-    auto *defIR = defExpr->codegen();
-    defIR->print(outs());
-    std::cout << "End of LLVM IR" << std::endl;
+    std::lock_guard<std::mutex> lock(CompilerMutex);
+    if (auto *defIR = defExpr->codegen()) {
+      std::string name = defExpr->getName();
+      if (TheReoptimizer) {
+        TheReoptimizer->instrument(defIR);
+      }
+      defIR->print(outs());
+      std::cout << "End of LLVM IR" << std::endl;
+      // Hand the module over to the JIT and start a new one for the next definition
+      ExitOnErr(TheJIT->addModule(
+          ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+      initializeModule();
+      // Keep the definition to generate variants of it specialized for int arguments
+      FunctionDefinitions[name] = std::move(defExpr);
+      if (TheReoptimizer) {
+        ExitOnErr(TheReoptimizer->publish(name));
+      }
+    }
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -47,9 +86,12 @@ static void HandleExtern() {
     std::cout << "Parsed an extern function." << std::endl;
     externExpr->debugMessage(0);
     std::cout << "LLVM IR:" << std::endl;
-    auto *externIR = externExpr->codegen();
-    externIR->print(outs());
-    std::cout << "End of LLVM IR" << std::endl;
+    std::lock_guard<std::mutex> lock(CompilerMutex);
+    if (auto *externIR = externExpr->codegen()) {
+      externIR->print(outs());
+      std::cout << "End of LLVM IR" << std::endl;
+      FunctionProtos[externExpr->getName()] = std::move(externExpr);
+    }
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -64,9 +106,35 @@ static void HandleTopLevelExpression() {
     std::cout << "Parsed a top level expression." << std::endl;
     topLevelExpr->debugMessage(0);
     std::cout << "LLVM IR:" << std::endl;
-    auto *topLevelIR = topLevelExpr->codegen();
-    topLevelIR->print(outs());
-    std::cout << "End of LLVM IR" << std::endl;
+    std::unique_lock<std::mutex> lock(CompilerMutex);
+    if (auto *topLevelIR = topLevelExpr->codegen()) {
+      topLevelIR->print(outs());
+      std::cout << "End of LLVM IR" << std::endl;
+
+      // Track the memory of the anonymous expression so it can be freed after running it
+      auto resourceTracker = TheJIT->getMainJITDylib().createResourceTracker();
+      Error error = TheJIT->addModule(
+          ThreadSafeModule(std::move(TheModule), std::move(TheContext)), resourceTracker);
+      initializeModule();
+      if (error) {
+        std::cerr << "Error: " << toString(std::move(error)) << std::endl;
+        return;
+      }
+
+      // Fails if the expression calls a function the JIT cannot find, e.g. an undefined
+      // extern; report it and free the expression like one that ran
+      auto exprSymbol = TheJIT->lookup("__anon_expr");
+      if (exprSymbol) {
+        // Functions may get re-optimized while the expression runs
+        lock.unlock();
+        double (*exprFunction)() = (double (*)())(intptr_t)exprSymbol->getAddress();
+        std::cout << "Evaluated to " << exprFunction() << std::endl;
+      } else {
+        std::cerr << "Error: " << toString(exprSymbol.takeError()) << std::endl;
+      }
+
+      ExitOnErr(resourceTracker->remove());
+    }
   } else {
     // Skip token for error recovery.
     getNextToken();
@@ -90,11 +158,74 @@ void registerSigHandler() {
   sigaction(SIGINT, &sigIntHandler, NULL);
 }
 
-int main() {
-    registerSigHandler();
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [--perf-map] [--jitdump] [--fast-math=strict|contract|reassoc|fast]"
+              << " [--serve=<socket> [--workers=<n>] [--max-batch=<n>]]"
+              << " [--reoptimize[=<calls>]] [--profile=<file>]" << std::endl;
+}
+
+/** @brief Finish re-optimizing and write the profiles
+ */
+static void stopReoptimizer() {
+  if (TheReoptimizer) {
+    TheReoptimizer->stop();
+    ExitOnErr(TheReoptimizer->dumpProfiles());
+    TheReoptimizer.reset();
+  }
+}
+
+int main(int argc, char **argv) {
+    JITProfilingOptions profilingOptions;
+    ServerOptions serverOptions;
+    ReoptimizerOptions reoptimizerOptions;
+    bool reoptimize = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--perf-map") == 0) {
+            profilingOptions.perfMap = true;
+        } else if (strcmp(argv[i], "--jitdump") == 0) {
+            profilingOptions.jitDump = true;
+        } else if (strncmp(argv[i], "--fast-math=", 12) == 0 &&
+                   parseFastMathPolicy(argv[i] + 12, DefaultFastMathPolicy)) {
+            continue;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serverOptions.socketPath = argv[i] + 8;
+        } else if (strncmp(argv[i], "--workers=", 10) == 0) {
+            serverOptions.workers = strtoul(argv[i] + 10, nullptr, 10);
+        } else if (strncmp(argv[i], "--max-batch=", 12) == 0 && atoi(argv[i] + 12) > 0) {
+            serverOptions.maxBatch = strtoul(argv[i] + 12, nullptr, 10);
+        } else if (strcmp(argv[i], "--reoptimize") == 0) {
+            reoptimize = true;
+        } else if (strncmp(argv[i], "--reoptimize=", 13) == 0 && atoi(argv[i] + 13) > 0) {
+            reoptimize = true;
+            reoptimizerOptions.hotThreshold = strtoull(argv[i] + 13, nullptr, 10);
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            reoptimize = true;
+            reoptimizerOptions.profilePath = argv[i] + 10;
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
     // setup operatorPrecedence mapping
     setOperatorPrecedence();
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    TheJIT->enableProfiling(profilingOptions);
     setupParser();
+    if (reoptimize) {
+        TheReoptimizer = std::make_unique<Reoptimizer>(*TheJIT, reoptimizerOptions);
+        ExitOnErr(TheReoptimizer->loadProfiles());
+    }
+
+    if (!serverOptions.socketPath.empty()) {
+        return runServer(serverOptions);
+    }
+    registerSigHandler();
 
     std::cout << "ready> ";
     getNextToken();
@@ -103,6 +234,7 @@ int main() {
         std::cout << "ready> ";
         switch (currToken) {
             case token_eof:
+                stopReoptimizer();
                 return 0;
             case ';': // ignore top-level semicolons for now.
                 getNextToken();
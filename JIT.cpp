@@ -0,0 +1,180 @@
+
+#include <cstdio>
+#include <mutex>
+#include <unistd.h>
+
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "JIT.hpp"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+/*
+ * perf map support
+ * perf looks for /tmp/perf-<pid>.map when it finds samples in anonymous executable memory.
+ * Each line is "<start address> <size> <symbol name>" with address and size in hex.
+ * Entries cannot be taken back, so only objects that stay loaded until the process exits
+ * are written: the memory of a removed object is reused by later ones, whose samples perf
+ * would attribute to the stale name. jitdump records when code is loaded and has no such
+ * problem.
+ */
+class PerfMap {
+    FILE *mapFile;
+    std::mutex mapMutex;
+
+public:
+    PerfMap() {
+        std::string path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+        mapFile = fopen(path.c_str(), "w");
+        if (!mapFile) {
+            errs() << "Unable to open perf map " << path << "\n";
+        }
+    }
+
+    ~PerfMap() {
+        if (mapFile) {
+            fclose(mapFile);
+        }
+    }
+
+    void addObject(const object::ObjectFile &obj, const RuntimeDyld::LoadedObjectInfo &loadInfo) {
+        if (!mapFile) {
+            return;
+        }
+
+        // The debug object has its sections relocated to their final load addresses
+        object::OwningBinary<object::ObjectFile> debugObjOwner = loadInfo.getObjectForDebug(obj);
+        const object::ObjectFile *debugObj = debugObjOwner.getBinary();
+        if (!debugObj) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mapMutex);
+        for (const auto &symbolAndSize : object::computeSymbolSizes(*debugObj)) {
+            const object::SymbolRef &symbol = symbolAndSize.first;
+
+            Expected<object::SymbolRef::Type> type = symbol.getType();
+            if (!type) {
+                consumeError(type.takeError());
+                continue;
+            }
+            if (*type != object::SymbolRef::ST_Function) {
+                continue;
+            }
+
+            Expected<StringRef> name = symbol.getName();
+            Expected<uint64_t> address = symbol.getAddress();
+            if (!name || !address) {
+                consumeError(name.takeError());
+                consumeError(address.takeError());
+                continue;
+            }
+
+            fprintf(mapFile, "%llx %llx %s\n", (unsigned long long)*address,
+                    (unsigned long long)symbolAndSize.second, name->str().c_str());
+        }
+        // perf may read the map while we are still running
+        fflush(mapFile);
+    }
+};
+
+KaleidoscopeJIT::KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
+                                 JITTargetMachineBuilder JTMB, DataLayout DL)
+    : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+      ObjectLayer(*this->ES, []() { return std::make_unique<SectionMemoryManager>(); }),
+      CompileLayer(*this->ES, ObjectLayer, std::make_unique<ConcurrentIRCompiler>(JTMB)),
+      MainJD(this->ES->createBareJITDylib("<main>")),
+      TM(cantFail(JTMB.createTargetMachine())),
+      StubsManager(createLocalIndirectStubsManagerBuilder(JTMB.getTargetTriple())()) {
+    // Vectorized loops may call libmvec (glibc's SIMD math library), load it so its symbols
+    // resolve like any other symbol of the process. LLVM only knows the names of its x86
+    // functions, libmvec on other targets (e.g. aarch64) names them differently.
+    VectorMathLibrary = JTMB.getTargetTriple().getArch() == Triple::x86_64 &&
+                        !sys::DynamicLibrary::LoadLibraryPermanently("libmvec.so.1");
+
+    // Resolve externs such as cos() against the symbols of the interpreter process
+    MainJD.addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(DL.getGlobalPrefix())));
+}
+
+KaleidoscopeJIT::~KaleidoscopeJIT() {
+    if (auto Err = ES->endSession()) {
+        ES->reportError(std::move(Err));
+    }
+}
+
+Expected<std::unique_ptr<KaleidoscopeJIT>> KaleidoscopeJIT::Create() {
+    auto EPC = SelfExecutorProcessControl::Create();
+    if (!EPC) {
+        return EPC.takeError();
+    }
+
+    auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+
+    // Compile for the host CPU so instructions such as FMA can be used
+    auto JTMB = JITTargetMachineBuilder::detectHost();
+    if (!JTMB) {
+        return JTMB.takeError();
+    }
+
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
+    if (!DL) {
+        return DL.takeError();
+    }
+
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(*JTMB), std::move(*DL));
+}
+
+void KaleidoscopeJIT::enableProfiling(const JITProfilingOptions &options) {
+    if (options.perfMap && !ThePerfMap) {
+        ThePerfMap = std::make_unique<PerfMap>();
+        // Objects of any other tracker may be removed, e.g. those of top level expressions
+        ResourceKey permanentKey = MainJD.getDefaultResourceTracker()->getKeyUnsafe();
+        ObjectLayer.setNotifyLoaded(
+            [this, permanentKey](MaterializationResponsibility &R, const object::ObjectFile &obj,
+                                 const RuntimeDyld::LoadedObjectInfo &loadInfo) {
+                bool permanent = false;
+                consumeError(R.withResourceKeyDo(
+                    [&](ResourceKey key) { permanent = key == permanentKey; }));
+                if (permanent) {
+                    ThePerfMap->addObject(obj, loadInfo);
+                }
+            });
+    }
+
+    if (options.jitDump && !JITDumpListener) {
+        // Owned by LLVM, returns null if LLVM was built without perf support
+        JITDumpListener = JITEventListener::createPerfJITEventListener();
+        if (JITDumpListener) {
+            ObjectLayer.registerJITEventListener(*JITDumpListener);
+        } else {
+            errs() << "jitdump is not supported by this LLVM build\n";
+        }
+    }
+}
+
+Error KaleidoscopeJIT::addModule(ThreadSafeModule TSM, ResourceTrackerSP RT) {
+    if (!RT) {
+        RT = MainJD.getDefaultResourceTracker();
+    }
+    return CompileLayer.add(RT, std::move(TSM));
+}
+
+Expected<JITEvaluatedSymbol> KaleidoscopeJIT::lookup(StringRef name) {
+    return ES->lookup({&MainJD}, Mangle(name.str()));
+}
+
+Error KaleidoscopeJIT::addStub(StringRef name, JITTargetAddress target) {
+    JITSymbolFlags flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+    if (auto Err = StubsManager->createStub(name, target, flags)) {
+        return Err;
+    }
+    JITEvaluatedSymbol stub = StubsManager->findStub(name, true);
+    return MainJD.define(absoluteSymbols({{Mangle(name.str()), stub}}));
+}
+
+Error KaleidoscopeJIT::redirectStub(StringRef name, JITTargetAddress target) {
+    return StubsManager->updatePointer(name, target);
+}
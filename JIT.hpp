@@ -0,0 +1,108 @@
+/*
+ **************************************** JIT ****************************************
+ * A small ORC based JIT that compiles the generated LLVM IR to native code in memory.
+ * Every function definition and top level expression lives in its own module, which is
+ * added to the JIT once it has been generated.
+ *
+ * Native code emitted by the JIT is anonymous to profilers, so the JIT can optionally
+ * publish symbols for every function it emits:
+ *      perf map    /tmp/perf-<pid>.map, picked up by `perf top` / `perf report`; only lists
+ *                  code that is never freed, so not top level expressions
+ *      jitdump     $JITDUMPDIR/.debug/jit/.../jit-<pid>.dump ($HOME if JITDUMPDIR is unset),
+ *                  merged into a profile by `perf inject --jit`
+ *
+ * A function can also be published as a stub, an indirect jump through a pointer, so that
+ * the code it runs can be replaced later while other modules keep calling the stub.
+ */
+
+#ifndef JIT_H_
+#define JIT_H_
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+/* Symbols the JIT should publish for profilers */
+struct JITProfilingOptions {
+    bool perfMap = false;
+    bool jitDump = false;
+};
+
+class PerfMap;
+
+class KaleidoscopeJIT {
+    std::unique_ptr<ExecutionSession> ES;
+    DataLayout DL;
+    MangleAndInterner Mangle;
+    RTDyldObjectLinkingLayer ObjectLayer;
+    IRCompileLayer CompileLayer;
+    JITDylib &MainJD;
+    std::unique_ptr<TargetMachine> TM;
+    std::unique_ptr<IndirectStubsManager> StubsManager;
+    bool VectorMathLibrary;
+    std::unique_ptr<PerfMap> ThePerfMap;
+    JITEventListener *JITDumpListener = nullptr;
+
+public:
+    KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES, JITTargetMachineBuilder JTMB,
+                    DataLayout DL);
+    ~KaleidoscopeJIT();
+
+    /** @brief Create a JIT for the host the interpreter is running on
+     *  @return the JIT, or the error that prevented creating it
+     */
+    static Expected<std::unique_ptr<KaleidoscopeJIT>> Create();
+
+    /** @brief Start publishing symbols of emitted functions for profilers
+     *  Only functions emitted after this call are published.
+     */
+    void enableProfiling(const JITProfilingOptions &options);
+
+    const DataLayout &getDataLayout() const { return DL; }
+
+    /* Target the JIT compiles for, used for cost models of optimizations */
+    TargetMachine &getTargetMachine() { return *TM; }
+
+    /* Whether the x86 SIMD math functions of glibc's libmvec can be called from JIT code */
+    bool hasVectorMathLibrary() const { return VectorMathLibrary; }
+
+    JITDylib &getMainJITDylib() { return MainJD; }
+
+    /** @brief Compile a module into the JIT
+     *  @param RT resource tracker owning the module, the dylib's default tracker if null
+     */
+    Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr);
+
+    /** @brief Look up the address of a JIT compiled function, compiling it if necessary
+     */
+    Expected<JITEvaluatedSymbol> lookup(StringRef name);
+
+    /** @brief Define `name` as a stub jumping to `target`
+     */
+    Error addStub(StringRef name, JITTargetAddress target);
+
+    /** @brief Make the stub `name` jump to `target` from now on
+     *  The jump target is replaced by a single pointer sized store, so every call runs
+     *  either the old or the new code; calls already running finish in the old code.
+     */
+    Error redirectStub(StringRef name, JITTargetAddress target);
+};
+
+#endif
@@ -11,6 +11,8 @@
  *      ProtoExpr
  *      FunctionExpr
  *      CallExpr
+ *      IfExpr
+ *      ForExpr
  * 
  * NumberExpr ::= number_token
  * VariableExpr ::= identifier_token
@@ -20,6 +22,11 @@
  * PrimExpr ::= VariableExpr
  * PrimExpr ::= CallExpr
  * PrimExpr ::= ParenExpr 
+ * PrimExpr ::= IfExpr
+ * PrimExpr ::= ForExpr
+ * IfExpr ::= if Expr then Expr else Expr
+ * ForExpr ::= for identifier_token = Expr , Expr in Expr
+ * ForExpr ::= for identifier_token = Expr , Expr , Expr in Expr     (with step)
  * Expr ::= PrimExpr
  * Expr ::= Expr + Expr
  * Expr ::= Expr - Expr
@@ -28,11 +35,26 @@
  * 
  * ProtoExpr ::= identifier_token ( identifier_token identifier_token identifier_token )
  * FunctionExpr ::= def ProtoExpr Expr 
+ * FunctionExpr ::= def [ identifier_token ] ProtoExpr Expr     (fast-math policy annotation)
  * Extern ::= extern ProtoExpr
  * TopLevelExpr is stored as an anonymous FunctionExpr
  */
 
+#include <algorithm>
+#include <cmath>
 #include <map>
+#include <set>
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Pass.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
 
 #include "Parser.hpp"
 #include "Scanner.hpp"
@@ -74,8 +96,11 @@ int getOperatorPrecedence() {
  * Parsing function for different non-terminal symbols
  */
 
+std::string LastError;
+
 std::unique_ptr<ASTBaseExpr> LogError(const char *Str) {
-  std::cerr << "Error: %s" << std::endl;
+  std::cerr << "Error: " << Str << std::endl;
+  LastError = Str;
   return nullptr;
 }
 std::unique_ptr<ASTProtoExpr> LogErrorP(const char *Str) {
@@ -108,6 +133,8 @@ static std::unique_ptr<ASTBaseExpr> parseParenExpr() {
     if (currToken != ')') {
         return LogError("Missing \')\'");
     }
+    // eat ')'
+    getNextToken();
     return subExpr;
 }
 
@@ -159,9 +186,102 @@ static std::unique_ptr<ASTBaseExpr> parseIdentifierExpr() {
     return std::make_unique<ASTCallExpr>(identiferName, std::move(arguments));
 }
 
+/** @brief Parser helper function to parse IfExpr
+ *  @return Expression that represents a conditional
+ */
+static std::unique_ptr<ASTBaseExpr> parseIfExpr() {
+    // eat 'if'
+    getNextToken();
+    auto condition = parseExpression();
+    if (!condition) {
+        return nullptr;
+    }
+
+    if (currToken != token_then) {
+        return LogError("Expected then");
+    }
+    // eat 'then'
+    getNextToken();
+    auto thenExpr = parseExpression();
+    if (!thenExpr) {
+        return nullptr;
+    }
+
+    if (currToken != token_else) {
+        return LogError("Expected else");
+    }
+    // eat 'else'
+    getNextToken();
+    auto elseExpr = parseExpression();
+    if (!elseExpr) {
+        return nullptr;
+    }
+
+    return std::make_unique<ASTIfExpr>(std::move(condition), std::move(thenExpr),
+                                       std::move(elseExpr));
+}
+
+/** @brief Parser helper function to parse ForExpr
+ *  @return Expression that represents a loop
+ */
+static std::unique_ptr<ASTBaseExpr> parseForExpr() {
+    // eat 'for'
+    getNextToken();
+    if (currToken != token_identifier) {
+        return LogError("Expected identifier after for");
+    }
+    std::string varName = identifierStr;
+    // eat identifier
+    getNextToken();
+
+    if (currToken != '=') {
+        return LogError("Expected '=' after for");
+    }
+    // eat '='
+    getNextToken();
+    auto start = parseExpression();
+    if (!start) {
+        return nullptr;
+    }
+
+    if (currToken != ',') {
+        return LogError("Expected ',' after for start value");
+    }
+    // eat ','
+    getNextToken();
+    auto end = parseExpression();
+    if (!end) {
+        return nullptr;
+    }
+
+    // The step value is optional.
+    std::unique_ptr<ASTBaseExpr> step;
+    if (currToken == ',') {
+        // eat ','
+        getNextToken();
+        step = parseExpression();
+        if (!step) {
+            return nullptr;
+        }
+    }
+
+    if (currToken != token_in) {
+        return LogError("Expected 'in' after for");
+    }
+    // eat 'in'
+    getNextToken();
+    auto body = parseExpression();
+    if (!body) {
+        return nullptr;
+    }
+
+    return std::make_unique<ASTForExpr>(varName, std::move(start), std::move(end),
+                                        std::move(step), std::move(body));
+}
+
 /** @brief Parser helper function to parse PrimaryExpr
  *  @return Expression that represents a primary expression, could be an identifier, a number
- * or a parenthesis expression
+ * a parenthesis expression, an if or a for expression
  */
 static std::unique_ptr<ASTBaseExpr> parsePrimary() {
     switch (currToken) {
@@ -171,6 +291,10 @@ static std::unique_ptr<ASTBaseExpr> parsePrimary() {
             return parseNumberExpr();
         case '(':
             return parseParenExpr();
+        case token_if:
+            return parseIfExpr();
+        case token_for:
+            return parseForExpr();
         default:
             return LogError("unkown token when expecting a primary expression");
     }
@@ -250,10 +374,38 @@ static std::unique_ptr<ASTProtoExpr> parsePrototype() {
     return std::make_unique<ASTProtoExpr>(functionName, std::move(argumentNames));
 }
 
+/** @brief Parser helper function to parse the fast-math annotation of a definition, [policy]
+ *  @return true if there was no annotation or it named a valid policy
+ */
+static bool parseFastMathAnnotation(FastMathPolicy &policy) {
+    policy = fastmath_module;
+    if (currToken != '[') {
+        return true;
+    }
+    // eat '['
+    getNextToken();
+    if (currToken != token_identifier || !parseFastMathPolicy(identifierStr, policy)) {
+        LogError("Expected strict, contract, reassoc or fast in fast-math annotation");
+        return false;
+    }
+    // eat policy name
+    getNextToken();
+    if (currToken != ']') {
+        LogError("Expected ']' after fast-math annotation");
+        return false;
+    }
+    // eat ']'
+    getNextToken();
+    return true;
+}
+
 std::unique_ptr<ASTFunctionExpr> parseDefinition() {
     getNextToken();
+    FastMathPolicy fastMath;
+    if (!parseFastMathAnnotation(fastMath)) return nullptr;
     auto functionProto = parsePrototype();
     if (!functionProto) return nullptr;
+    functionProto->setFastMathPolicy(fastMath);
 
     // Parse the body of the function
     if (auto functionBody = parseExpression())
@@ -263,33 +415,582 @@ std::unique_ptr<ASTFunctionExpr> parseDefinition() {
 
 std::unique_ptr<ASTProtoExpr> parseExtern() {
     getNextToken();
-    return parsePrototype();
+    auto externProto = parsePrototype();
+    if (externProto) {
+        externProto->setIsExtern(true);
+    }
+    return externProto;
 }
 
-std::unique_ptr<ASTFunctionExpr> parseTopLevelExpression() {
+std::unique_ptr<ASTFunctionExpr> parseTopLevelExpression(const std::string &name) {
     if (auto expr = parseExpression()) {
         // Make an anonymous prototype
-        auto anonProto = std::make_unique<ASTProtoExpr>("__anon_expr", std::vector<std::string>());
+        auto anonProto = std::make_unique<ASTProtoExpr>(name, std::vector<std::string>());
         return std::make_unique<ASTFunctionExpr>(std::move(anonProto), std::move(expr));
     }
     return nullptr;
 }
 
+/*
+ **************************************** Type Inference ****************************************
+ * Types flow bottom up: number literals with an integral value are int, comparisons are bool
+ * and arithmetic is done in the larger type of its operands, bool arithmetic is done as int.
+ * A call with only double arguments uses the generic function and is double. A call with
+ * int arguments uses a specialization, whose result type is inferred from the callee's body.
+ * Code generation follows the same rules, using the types of the generated values.
+ */
+
+std::map<std::string, std::unique_ptr<ASTFunctionExpr>> FunctionDefinitions;
+bool SpecializeProfiledCalls = false;
+
+/* Int values are kept strictly between -2^53 and 2^53, where double arithmetic on integers
+ * is exact, so int arithmetic gives the same results as the double arithmetic it replaces */
+static const int64_t MaxExactInt = 1LL << 53;
+
+/* Whether numbers and arithmetic are generated as int, false while generating the double
+ * variant a function falls back to when int arithmetic leaves the exact range */
+static bool IntArithmetic = true;
+
+/* Result types assumed for specializations whose inference is in progress, by name */
+static std::map<std::string, ValueType> InferenceAssumptions;
+
+/* Names of the assumptions the inference in progress has read so far */
+static std::set<std::string> AssumptionsRead;
+
+/* Whether the current module is one of specializations, which are published to the JIT */
+static bool InSpecializationModule = false;
+
+static ValueType joinTypes(ValueType a, ValueType b) {
+    return std::max(a, b);
+}
+
+static bool isIntegral(double value) {
+    // Integers beyond 2^53 are not exact as double to begin with, leave them double, and
+    // neither is -0.0, an int would lose its sign
+    return value == std::floor(value) && std::fabs(value) < (double)MaxExactInt &&
+           !(value == 0 && std::signbit(value));
+}
+
+/** @brief Name of the variant of `name` specialized for the argument types, e.g. fib.i
+ */
+static std::string specializationName(const std::string &name,
+                                      const std::vector<ValueType> &argTypes) {
+    std::string mangled = name + ".";
+    for (ValueType type : argTypes) {
+        mangled += type == type_double ? 'd' : 'i';
+    }
+    return mangled;
+}
+
+/** @brief Find the definition and argument types of the specialization called `name`
+ *  @return the definition, or nullptr if `name` does not name a specialization
+ */
+static ASTFunctionExpr *findSpecialization(const std::string &name,
+                                           std::vector<ValueType> &argTypes) {
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos) {
+        return nullptr;
+    }
+    auto definitionIt = FunctionDefinitions.find(name.substr(0, dot));
+    if (definitionIt == FunctionDefinitions.end()) {
+        return nullptr;
+    }
+
+    argTypes.clear();
+    for (char mangled : name.substr(dot + 1)) {
+        if (mangled != 'i' && mangled != 'd') {
+            return nullptr;
+        }
+        argTypes.push_back(mangled == 'i' ? type_int : type_double);
+    }
+    if (argTypes.size() != definitionIt->second->getArgs().size() ||
+        std::find(argTypes.begin(), argTypes.end(), type_int) == argTypes.end()) {
+        return nullptr;
+    }
+    return definitionIt->second.get();
+}
+
+/** @brief Find the definition a call with arguments of the given types is specialized from
+ *  Bool (and not yet known) argument types are replaced by int in argTypes.
+ *  @return the definition, or nullptr if the call uses the generic double function
+ */
+static ASTFunctionExpr *getSpecializableDefinition(const std::string &callee,
+                                                   std::vector<ValueType> &argTypes) {
+    bool hasIntArgument = false;
+    for (ValueType &type : argTypes) {
+        if (type != type_double) {
+            type = type_int;
+            hasIntArgument = true;
+        }
+    }
+
+    // The call has to match the definition itself, a call that does not is reported as
+    // an error against the prototype
+    auto definitionIt = FunctionDefinitions.find(callee);
+    auto protoIt = FunctionProtos.find(callee);
+    if (!IntArithmetic || !hasIntArgument || definitionIt == FunctionDefinitions.end() ||
+        protoIt == FunctionProtos.end() || protoIt->second->getIsExtern() ||
+        definitionIt->second->getArgs().size() != argTypes.size() ||
+        definitionIt->second->callsExtern() ||
+        (definitionIt->second->isProfiled() && !SpecializeProfiledCalls)) {
+        return nullptr;
+    }
+    return definitionIt->second.get();
+}
+
+ValueType ASTNumberExpr::inferType(const TypeEnv &env) {
+    return isIntegral(this->value) ? type_int : type_double;
+}
+
+ValueType ASTVariableExpr::inferType(const TypeEnv &env) {
+    auto typeIt = env.find(this->identifier);
+    return typeIt == env.end() ? type_double : typeIt->second;
+}
+
+ValueType ASTBinaryExpr::inferType(const TypeEnv &env) {
+    ValueType L = this->LHS->inferType(env);
+    ValueType R = this->RHS->inferType(env);
+    if (this->op == '<') {
+        return type_bool;
+    }
+    ValueType result = joinTypes(L, R);
+    return result == type_bool ? type_int : result;
+}
+
+ValueType ASTCallExpr::inferType(const TypeEnv &env) {
+    std::vector<ValueType> argTypes;
+    for (auto &argument : this->arguments) {
+        argTypes.push_back(argument->inferType(env));
+    }
+    if (ASTFunctionExpr *definition = getSpecializableDefinition(this->callee, argTypes)) {
+        return definition->inferReturnType(argTypes);
+    }
+    return type_double;
+}
+
+ValueType ASTIfExpr::inferType(const TypeEnv &env) {
+    return joinTypes(this->thenExpr->inferType(env), this->elseExpr->inferType(env));
+}
+
+ValueType ASTForExpr::inferType(const TypeEnv &env) {
+    // for expr always returns 0
+    return type_int;
+}
+
+ValueType ASTFunctionExpr::inferReturnType(const std::vector<ValueType> &argTypes) {
+    auto inferredIt = this->inferredReturnTypes.find(argTypes);
+    if (inferredIt != this->inferredReturnTypes.end()) {
+        return inferredIt->second;
+    }
+
+    std::string name = specializationName(this->getName(), argTypes);
+
+    // A recursive call sees the type assumed so far
+    auto assumptionIt = InferenceAssumptions.find(name);
+    if (assumptionIt != InferenceAssumptions.end()) {
+        AssumptionsRead.insert(name);
+        return assumptionIt->second;
+    }
+    std::set<std::string> callerAssumptionsRead;
+    callerAssumptionsRead.swap(AssumptionsRead);
+
+    TypeEnv env;
+    const std::vector<std::string> &argNames = this->prototype->getArgs();
+    for (unsigned i = 0, e = argNames.size(); i != e; ++i) {
+        env[argNames[i]] = argTypes[i];
+    }
+
+    // Start by assuming nothing and infer the body again until the result agrees with the
+    // assumption. Types only grow, so this takes at most one round per type.
+    InferenceAssumptions[name] = type_unknown;
+    ValueType returnType;
+    while ((returnType = this->body->inferType(env)) != InferenceAssumptions[name]) {
+        InferenceAssumptions[name] = returnType;
+    }
+    InferenceAssumptions.erase(name);
+
+    // A function that never returns could have any type, it is generated returning double
+    if (returnType == type_unknown) {
+        returnType = type_double;
+    }
+
+    // A result that read what is assumed about another specialization in progress may still
+    // change, and so may the result of the caller. Definitions only call earlier ones and
+    // themselves, so that only happens for specializations of the same function.
+    AssumptionsRead.erase(name);
+    if (AssumptionsRead.empty()) {
+        this->inferredReturnTypes[argTypes] = returnType;
+    }
+    AssumptionsRead.insert(callerAssumptionsRead.begin(), callerAssumptionsRead.end());
+    return returnType;
+}
+
 /*
  **************************************** Code Gen ****************************************
  */
 
+FastMathPolicy DefaultFastMathPolicy = fastmath_strict;
+
+bool parseFastMathPolicy(const std::string &name, FastMathPolicy &policy) {
+    static const std::map<std::string, FastMathPolicy> policies = {
+        {"strict", fastmath_strict},
+        {"contract", fastmath_contract},
+        {"reassoc", fastmath_reassoc},
+        {"fast", fastmath_fast},
+    };
+    auto policyIt = policies.find(name);
+    if (policyIt == policies.end()) {
+        return false;
+    }
+    policy = policyIt->second;
+    return true;
+}
+
+/** @brief Translate a fast-math policy into the flags the builder puts on floating point
+ *  operations, and the function attributes the backend looks at
+ */
+static FastMathFlags applyFastMathPolicy(FastMathPolicy policy, Function *func) {
+    if (policy == fastmath_module) {
+        policy = DefaultFastMathPolicy;
+    }
+
+    FastMathFlags flags;
+    switch (policy) {
+    case fastmath_fast:
+        flags.setFast();
+        func->addFnAttr("unsafe-fp-math", "true");
+        func->addFnAttr("no-nans-fp-math", "true");
+        func->addFnAttr("no-infs-fp-math", "true");
+        func->addFnAttr("no-signed-zeros-fp-math", "true");
+        break;
+    case fastmath_reassoc:
+        flags.setAllowReassoc();
+        flags.setAllowReciprocal();
+        flags.setAllowContract();
+        break;
+    case fastmath_contract:
+        flags.setAllowContract();
+        break;
+    default:
+        break;
+    }
+    return flags;
+}
+
 std::unique_ptr<LLVMContext> TheContext;
 std::unique_ptr<IRBuilder<>> Builder;
 std::unique_ptr<Module> TheModule;
 std::map<std::string, Value *> NamedValues;
+std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+std::unique_ptr<KaleidoscopeJIT> TheJIT;
+std::map<std::string, std::unique_ptr<ASTProtoExpr>> FunctionProtos;
+std::mutex CompilerMutex;
+
+/* Loop header of the function being generated that self tail calls jump back to, with one
+ * phi per function argument receiving the arguments of the tail call */
+static BasicBlock *TailRecurseBlock = nullptr;
+static std::vector<PHINode *> TailRecurseArguments;
+
+/* Block of the function being generated that int arithmetic branches to when a result leaves
+ * the exact range, created on first use. The function then returns what its double variant
+ * computes from the current arguments; an int result that is not exact is returned as
+ * OverflowResult, which makes the caller fall back in turn. */
+static BasicBlock *OverflowBlock = nullptr;
+static const int64_t OverflowResult = INT64_MIN;
 
 Value *LogErrorV(const char *Str) {
   LogError(Str);
   return nullptr;
 }
 
+static Type *getLLVMType(ValueType type) {
+    switch (type) {
+    case type_bool:
+        return Type::getInt1Ty(*TheContext);
+    case type_int:
+        return Type::getInt64Ty(*TheContext);
+    default:
+        return Type::getDoubleTy(*TheContext);
+    }
+}
+
+static ValueType getValueType(Type *type) {
+    if (type->isIntegerTy(1)) {
+        return type_bool;
+    }
+    return type->isIntegerTy() ? type_int : type_double;
+}
+
+static ValueType getValueType(Value *value) {
+    return getValueType(value->getType());
+}
+
+/** @brief Convert a value to a type at least as large as its own
+ *  @return the converted value, or nullptr if `type` is smaller, which would lose the value
+ */
+static Value *convertValue(Value *value, ValueType type) {
+    ValueType valueType = getValueType(value);
+    if (valueType == type) {
+        return value;
+    }
+    if (valueType > type) {
+        return LogErrorV("Value does not match its inferred type");
+    }
+    if (type == type_double) {
+        // Convert bool 0/1 to double 0.0 or 1.0
+        if (valueType == type_bool) {
+            return Builder->CreateUIToFP(value, getLLVMType(type), "booltmp");
+        }
+        return Builder->CreateSIToFP(value, getLLVMType(type), "inttmp");
+    }
+    return Builder->CreateZExt(value, getLLVMType(type), "booltmp");
+}
+
+/** @brief Type the arithmetic on values of a type is done in, bools are added etc. as ints
+ */
+static ValueType getArithmeticType(ValueType type) {
+    if (!IntArithmetic) {
+        return type_double;
+    }
+    return type == type_bool ? type_int : type;
+}
+
+/** @brief Branch to the overflow block of the current function if `overflowed` is true
+ */
+static void branchOnOverflow(Value *overflowed) {
+    Function *func = Builder->GetInsertBlock()->getParent();
+    if (!OverflowBlock) {
+        OverflowBlock = BasicBlock::Create(*TheContext, "overflow", func);
+    }
+    BasicBlock *exactBlock = BasicBlock::Create(*TheContext, "exact", func);
+    Builder->CreateCondBr(overflowed, OverflowBlock, exactBlock,
+                          MDBuilder(*TheContext).createBranchWeights(1, 1000));
+    Builder->SetInsertPoint(exactBlock);
+}
+
+/** @brief Whether an int is in the exact range
+ */
+static Value *createIsExactIntRange(Value *value) {
+    // -2^53 < value < 2^53, shifted into one unsigned comparison
+    Type *type = value->getType();
+    Value *shifted = Builder->CreateAdd(value, ConstantInt::get(type, MaxExactInt - 1));
+    return Builder->CreateICmpULT(shifted, ConstantInt::get(type, 2 * MaxExactInt - 1),
+                                  "inrange");
+}
+
+/** @brief Check that the result of int arithmetic is in the exact range
+ *  @param overflowed whether the operation overflowed i64 already, or nullptr
+ */
+static Value *checkExactInt(Value *result, Value *overflowed) {
+    Value *outOfRange = Builder->CreateNot(createIsExactIntRange(result), "outofrange");
+    branchOnOverflow(overflowed ? Builder->CreateOr(overflowed, outOfRange) : outOfRange);
+    return result;
+}
+
+/** @brief Check that the sum of two exact ints, or their difference if `subtract`, is in the
+ *  exact range. Adding a constant can only leave the range on the side of its sign, so only
+ *  that bound is checked, which a condition on the other operand (n < 1 before n - 1) lets
+ *  the optimizer prove.
+ */
+static Value *checkExactSum(Value *L, Value *R, bool subtract) {
+    Value *result = subtract ? Builder->CreateNSWSub(L, R, "subtmp")
+                             : Builder->CreateNSWAdd(L, R, "addtmp");
+
+    // Sign of what is added to the other operand, if it is a constant
+    int change = 2;
+    if (auto *constant = dyn_cast<ConstantInt>(R)) {
+        change = constant->getValue().getSExtValue() > 0 ? 1 : constant->isZero() ? 0 : -1;
+        change = subtract ? -change : change;
+    } else if (auto *constant = dyn_cast<ConstantInt>(L)) {
+        if (!subtract) {
+            change = constant->getValue().getSExtValue() > 0 ? 1 : constant->isZero() ? 0 : -1;
+        }
+    }
+
+    Type *type = result->getType();
+    switch (change) {
+    case 0:
+        return result;
+    case 1:
+        branchOnOverflow(Builder->CreateICmpSGE(result, ConstantInt::get(type, MaxExactInt),
+                                                "outofrange"));
+        return result;
+    case -1:
+        branchOnOverflow(Builder->CreateICmpSLE(result, ConstantInt::get(type, -MaxExactInt, true),
+                                                "outofrange"));
+        return result;
+    default:
+        return checkExactInt(result, nullptr);
+    }
+}
+
+/** @brief Check that the product of two exact ints is in the exact range and is not a zero
+ *  that doubles give the sign of a negative operand (-3 * 0 is -0.0, which an int cannot
+ *  hold). With a constant operand only the sign of the other one is checked.
+ */
+static Value *checkExactProduct(Value *L, Value *R) {
+    Value *product = Builder->CreateBinaryIntrinsic(Intrinsic::smul_with_overflow, L, R);
+    Value *result = Builder->CreateExtractValue(product, 0, "multmp");
+    Value *overflowed = Builder->CreateExtractValue(product, 1, "mulovf");
+
+    Value *other = L;
+    auto *constant = dyn_cast<ConstantInt>(R);
+    if (!constant) {
+        constant = dyn_cast<ConstantInt>(L);
+        other = R;
+    }
+    Value *zero = ConstantInt::get(result->getType(), 0);
+    Value *negativeZero;
+    if (!constant) {
+        // Without overflow the product is zero when an operand is, the other one's sign decides
+        negativeZero = Builder->CreateAnd(Builder->CreateICmpEQ(result, zero),
+                                          Builder->CreateICmpSLT(Builder->CreateOr(L, R), zero));
+    } else if (constant->isNegative()) {
+        negativeZero = Builder->CreateICmpEQ(other, zero);
+    } else if (constant->isZero()) {
+        negativeZero = Builder->CreateICmpSLT(other, zero);
+    } else {
+        negativeZero = Builder->getFalse();
+    }
+    return checkExactInt(result, Builder->CreateOr(overflowed, negativeZero, "negzero"));
+}
+
+/** @brief Whether a double is an integer in the exact range, so it converts to int exactly
+ *  -0.0 is not, an int would lose its sign.
+ */
+static Value *createIsExactInt(Value *value) {
+    Value *truncated = Builder->CreateUnaryIntrinsic(Intrinsic::trunc, value);
+    Value *magnitude = Builder->CreateUnaryIntrinsic(Intrinsic::fabs, value);
+    Value *limit = ConstantFP::get(*TheContext, APFloat((double)MaxExactInt));
+    Type *bitsType = Type::getInt64Ty(*TheContext);
+    Value *negativeZero = Builder->CreateICmpEQ(
+        Builder->CreateBitCast(value, bitsType), ConstantInt::get(bitsType, INT64_MIN, true),
+        "isnegzero");
+    return Builder->CreateAnd(
+        Builder->CreateAnd(Builder->CreateFCmpOEQ(value, truncated, "isintegral"),
+                           Builder->CreateFCmpOLT(magnitude, limit, "inrange")),
+        Builder->CreateNot(negativeZero));
+}
+
+/** @brief Convert a value used as a condition to a bool, anything but 0 is true
+ */
+static Value *convertCondition(Value *value, const char *name) {
+    switch (getValueType(value)) {
+    case type_bool:
+        return value;
+    case type_int:
+        return Builder->CreateICmpNE(value, ConstantInt::get(value->getType(), 0), name);
+    default:
+        return Builder->CreateFCmpONE(value, ConstantFP::get(*TheContext, APFloat(0.0)), name);
+    }
+}
+
+/** @brief Types of the variables currently in scope
+ */
+static TypeEnv getTypeEnv() {
+    TypeEnv env;
+    for (auto &namedValue : NamedValues) {
+        if (namedValue.second) {
+            env[namedValue.first] = getValueType(namedValue.second);
+        }
+    }
+    return env;
+}
+
+Function *getFunction(const std::string &name) {
+    // First, see if the function has already been added to the current module.
+    if (auto *func = TheModule->getFunction(name)) {
+        return func;
+    }
+
+    // If not, check whether we can codegen the declaration from some existing prototype.
+    auto protoIt = FunctionProtos.find(name);
+    if (protoIt != FunctionProtos.end()) {
+        return protoIt->second->codegen();
+    }
+
+    // If no existing prototype exists, return null.
+    return nullptr;
+}
+
+/* Math functions from libm that are lowered to LLVM intrinsics when they are declared with
+ * extern, so LLVM can constant fold, hoist and vectorize them instead of seeing opaque calls */
+struct BuiltinFunction {
+    Intrinsic::ID intrinsic;
+    unsigned arity;
+};
+
+static const std::map<std::string, BuiltinFunction> builtinFunctions = {
+    {"sin", {Intrinsic::sin, 1}},
+    {"cos", {Intrinsic::cos, 1}},
+    {"exp", {Intrinsic::exp, 1}},
+    {"log", {Intrinsic::log, 1}},
+    {"sqrt", {Intrinsic::sqrt, 1}},
+    {"pow", {Intrinsic::pow, 2}},
+    {"fabs", {Intrinsic::fabs, 1}},
+    {"fmin", {Intrinsic::minnum, 2}},
+    {"fmax", {Intrinsic::maxnum, 2}},
+};
+
+/** @brief Find the builtin calls to `name` are lowered to
+ *  @return the builtin, or nullptr if calls to `name` stay plain calls
+ */
+static const BuiltinFunction *findBuiltinFunction(const std::string &name) {
+    auto builtinIt = builtinFunctions.find(name);
+    if (builtinIt == builtinFunctions.end()) {
+        return nullptr;
+    }
+
+    // A Kaleidoscope definition of the same name takes precedence over the builtin
+    auto protoIt = FunctionProtos.find(name);
+    if (protoIt == FunctionProtos.end() || !protoIt->second->getIsExtern() ||
+        protoIt->second->getArgs().size() != builtinIt->second.arity) {
+        return nullptr;
+    }
+    return &builtinIt->second;
+}
+
+/** @brief Find the intrinsic an extern math function is lowered to
+ *  @return the intrinsic declaration, or nullptr if calls to `name` stay plain calls
+ */
+static Function *getBuiltinIntrinsic(const std::string &name) {
+    const BuiltinFunction *builtin = findBuiltinFunction(name);
+    if (!builtin) {
+        return nullptr;
+    }
+    return Intrinsic::getDeclaration(TheModule.get(), builtin->intrinsic,
+                                     {Type::getDoubleTy(*TheContext)});
+}
+
+bool ASTCallExpr::callsExtern() {
+    for (auto &argument : this->arguments) {
+        if (argument->callsExtern()) {
+            return true;
+        }
+    }
+
+    auto protoIt = FunctionProtos.find(this->callee);
+    if (protoIt != FunctionProtos.end() && protoIt->second->getIsExtern()) {
+        return !findBuiltinFunction(this->callee);
+    }
+    // A function calling itself is not in FunctionDefinitions before it is compiled
+    auto definitionIt = FunctionDefinitions.find(this->callee);
+    return definitionIt != FunctionDefinitions.end() && definitionIt->second->callsExtern();
+}
+
+bool ASTFunctionExpr::callsExtern() {
+    // Definitions cannot be replaced, so neither can the answer
+    if (!this->callsExternKnown) {
+        this->callsExternKnown = true;
+        this->callsExternResult = this->body->callsExtern();
+    }
+    return this->callsExternResult;
+}
+
 Value *ASTNumberExpr::codegen() {
+  if (IntArithmetic && isIntegral(this->value)) {
+    return ConstantInt::get(Type::getInt64Ty(*TheContext), (int64_t)this->value, true);
+  }
   return ConstantFP::get(*TheContext, APFloat(this->value));
 }
 
@@ -307,6 +1008,27 @@ Value *ASTBinaryExpr::codegen() {
   if (!L || !R)
     return nullptr;
 
+  // Operate in the larger type of the operands
+  ValueType type = getArithmeticType(joinTypes(getValueType(L), getValueType(R)));
+  L = convertValue(L, type);
+  R = convertValue(R, type);
+
+  if (type == type_int) {
+    // Sums and differences of exact ints cannot overflow i64, only leave the exact range
+    switch (this->op) {
+    case '+':
+      return checkExactSum(L, R, false);
+    case '-':
+      return checkExactSum(L, R, true);
+    case '*':
+      return checkExactProduct(L, R);
+    case '<':
+      return Builder->CreateICmpSLT(L, R, "cmptmp");
+    default:
+      return LogErrorV("invalid binary operator");
+    }
+  }
+
   switch (this->op) {
   case '+':
     return Builder->CreateFAdd(L, R, "addtmp");
@@ -315,10 +1037,7 @@ Value *ASTBinaryExpr::codegen() {
   case '*':
     return Builder->CreateFMul(L, R, "multmp");
   case '<':
-    L = Builder->CreateFCmpULT(L, R, "cmptmp");
-    // Convert bool 0/1 to double 0.0 or 1.0
-    return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext),
-                                 "booltmp");
+    return Builder->CreateFCmpULT(L, R, "cmptmp");
   default:
     return LogErrorV("invalid binary operator");
   }
@@ -326,7 +1045,7 @@ Value *ASTBinaryExpr::codegen() {
 
 Value *ASTCallExpr::codegen() {
     // Look up the name in the global module table.
-    Function *calleeFunction = TheModule->getFunction(this->callee);
+    Function *calleeFunction = getFunction(this->callee);
     if (!calleeFunction){
         return LogErrorV("Unknown function referenced");
     }
@@ -337,14 +1056,218 @@ Value *ASTCallExpr::codegen() {
     }
 
     std::vector<Value *> argumentValue;
+    std::vector<ValueType> argumentTypes;
     for (unsigned i = 0, e = this->arguments.size(); i != e; ++i) {
         argumentValue.push_back(this->arguments[i]->codegen());
         if (!argumentValue.back()){
             return nullptr;
         }
+        argumentTypes.push_back(getValueType(argumentValue.back()));
+    }
+
+    // Call the variant of a definition specialized for int arguments if there are any
+    if (ASTFunctionExpr *definition = getSpecializableDefinition(this->callee, argumentTypes)) {
+        calleeFunction = definition->codegenSpecialization(argumentTypes);
+        if (!calleeFunction) {
+            return nullptr;
+        }
+    }
+
+    // Pass every argument with the type the callee expects
+    for (unsigned i = 0, e = argumentValue.size(); i != e; ++i) {
+        argumentValue[i] = convertValue(argumentValue[i],
+                                        getValueType(calleeFunction->getArg(i)->getType()));
+        if (!argumentValue[i]) {
+            return nullptr;
+        }
+    }
+
+    if (this->isTailCall && TailRecurseBlock && TailRecurseBlock->getParent() == calleeFunction) {
+        // Self tail call: pass the arguments to the loop header and jump back to it
+        BasicBlock *callBlock = Builder->GetInsertBlock();
+        for (unsigned i = 0, e = argumentValue.size(); i != e; ++i) {
+            TailRecurseArguments[i]->addIncoming(argumentValue[i], callBlock);
+        }
+        Builder->CreateBr(TailRecurseBlock);
+
+        // Nothing after the jump is reached, let the caller finish off in an unreachable
+        // block that the optimizer deletes
+        BasicBlock *deadBlock = BasicBlock::Create(*TheContext, "aftertailcall", calleeFunction);
+        Builder->SetInsertPoint(deadBlock);
+        return UndefValue::get(calleeFunction->getReturnType());
+    }
+
+    if (Function *intrinsic = getBuiltinIntrinsic(this->callee)) {
+        return Builder->CreateCall(intrinsic, argumentValue, "calltmp");
+    }
+
+    CallInst *result = Builder->CreateCall(calleeFunction, argumentValue, "calltmp");
+    if (getValueType(result) == type_int) {
+        // The result is OverflowResult or an exact int
+        Type *type = result->getType();
+        Metadata *ranges[] = {
+            ConstantAsMetadata::get(ConstantInt::get(type, OverflowResult, true)),
+            ConstantAsMetadata::get(ConstantInt::get(type, OverflowResult + 1, true)),
+            ConstantAsMetadata::get(ConstantInt::get(type, 1 - MaxExactInt, true)),
+            ConstantAsMetadata::get(ConstantInt::get(type, MaxExactInt, true))};
+        result->setMetadata(LLVMContext::MD_range, MDNode::get(*TheContext, ranges));
+        // The specialization fell back to double arithmetic and its result is not exact
+        branchOnOverflow(Builder->CreateICmpEQ(
+            result, ConstantInt::get(result->getType(), OverflowResult, true), "overflowed"));
+    }
+    return result;
+}
+
+Value *ASTIfExpr::codegen() {
+    Value *conditionValue = this->condition->codegen();
+    if (!conditionValue) {
+        return nullptr;
+    }
+
+    // Convert condition to a bool by comparing non-equal to 0.
+    conditionValue = convertCondition(conditionValue, "ifcond");
+
+    Function *func = Builder->GetInsertBlock()->getParent();
+
+    // Create blocks for the then and else cases. Insert the 'then' block at the end of the
+    // function, the others are inserted once the 'then' branch is generated.
+    BasicBlock *thenBlock = BasicBlock::Create(*TheContext, "then", func);
+    BasicBlock *elseBlock = BasicBlock::Create(*TheContext, "else");
+    BasicBlock *mergeBlock = BasicBlock::Create(*TheContext, "ifcont");
+
+    Builder->CreateCondBr(conditionValue, thenBlock, elseBlock);
+
+    // Emit then value.
+    Builder->SetInsertPoint(thenBlock);
+    Value *thenValue = this->thenExpr->codegen();
+    if (!thenValue) {
+        return nullptr;
+    }
+    // Codegen of 'then' can change the current block, update thenBlock for the PHI.
+    thenBlock = Builder->GetInsertBlock();
+
+    // Emit else block.
+    func->getBasicBlockList().push_back(elseBlock);
+    Builder->SetInsertPoint(elseBlock);
+    Value *elseValue = this->elseExpr->codegen();
+    if (!elseValue) {
+        return nullptr;
+    }
+    // Codegen of 'else' can change the current block, update elseBlock for the PHI.
+    elseBlock = Builder->GetInsertBlock();
+
+    // Both branches provide the larger type of the two, which is known only now
+    ValueType type = joinTypes(getValueType(thenValue), getValueType(elseValue));
+    Builder->SetInsertPoint(thenBlock);
+    thenValue = convertValue(thenValue, type);
+    Builder->CreateBr(mergeBlock);
+    Builder->SetInsertPoint(elseBlock);
+    elseValue = convertValue(elseValue, type);
+    Builder->CreateBr(mergeBlock);
+
+    // Emit merge block.
+    func->getBasicBlockList().push_back(mergeBlock);
+    Builder->SetInsertPoint(mergeBlock);
+    PHINode *phi = Builder->CreatePHI(getLLVMType(type), 2, "iftmp");
+    phi->addIncoming(thenValue, thenBlock);
+    phi->addIncoming(elseValue, elseBlock);
+    return phi;
+}
+
+Value *ASTForExpr::codegen() {
+    // Emit the start code first, without 'variable' in scope.
+    Value *startValue = this->start->codegen();
+    if (!startValue) {
+        return nullptr;
+    }
+
+    // The variable has the larger type of the start and the step value, the type of the
+    // step value is inferred as it is only generated inside the loop.
+    ValueType type = getValueType(startValue);
+    if (this->step) {
+        TypeEnv env = getTypeEnv();
+        env[this->varName] = type;
+        type = joinTypes(type, this->step->inferType(env));
+    }
+    type = getArithmeticType(type);
+    startValue = convertValue(startValue, type);
+
+    // Make the new basic block for the loop header, inserting after current block.
+    Function *func = Builder->GetInsertBlock()->getParent();
+    BasicBlock *preheaderBlock = Builder->GetInsertBlock();
+    BasicBlock *loopBlock = BasicBlock::Create(*TheContext, "loop", func);
+
+    // Insert an explicit fall through from the current block to the loopBlock.
+    Builder->CreateBr(loopBlock);
+
+    // Start insertion in loopBlock.
+    Builder->SetInsertPoint(loopBlock);
+
+    // Start the PHI node with an entry for start.
+    PHINode *variable = Builder->CreatePHI(getLLVMType(type), 2, this->varName);
+    variable->addIncoming(startValue, preheaderBlock);
+
+    // Within the loop, the variable is defined equal to the PHI node. If it shadows an
+    // existing variable, we have to restore it, so save it now.
+    Value *oldValue = NamedValues[this->varName];
+    NamedValues[this->varName] = variable;
+
+    // Emit the body of the loop. Like any expr it computes a value, which is ignored.
+    if (!this->body->codegen()) {
+        return nullptr;
+    }
+
+    // Emit the step value, 1 if not specified.
+    Value *stepValue = nullptr;
+    if (this->step) {
+        stepValue = this->step->codegen();
+        if (!stepValue) {
+            return nullptr;
+        }
+    } else {
+        stepValue = ConstantInt::get(Type::getInt64Ty(*TheContext), 1);
+    }
+    stepValue = convertValue(stepValue, type);
+    if (!stepValue) {
+        return nullptr;
+    }
+    Value *nextValue =
+        type == type_int
+            ? checkExactSum(variable, stepValue, false)
+            : Builder->CreateFAdd(variable, stepValue, "nextvar");
+
+    // Compute the end condition.
+    Value *endCondition = this->end->codegen();
+    if (!endCondition) {
+        return nullptr;
+    }
+
+    // Convert condition to a bool by comparing non-equal to 0.
+    endCondition = convertCondition(endCondition, "loopcond");
+
+    // Create the "after loop" block and insert it.
+    BasicBlock *loopEndBlock = Builder->GetInsertBlock();
+    BasicBlock *afterBlock = BasicBlock::Create(*TheContext, "afterloop", func);
+
+    // Insert the conditional branch into the end of loopEndBlock.
+    Builder->CreateCondBr(endCondition, loopBlock, afterBlock);
+
+    // Any new code will be inserted in afterBlock.
+    Builder->SetInsertPoint(afterBlock);
+
+    // Add a new entry to the PHI node for the backedge.
+    variable->addIncoming(nextValue, loopEndBlock);
+
+    // Restore the unshadowed variable.
+    if (oldValue) {
+        NamedValues[this->varName] = oldValue;
+    } else {
+        NamedValues.erase(this->varName);
     }
 
-    return Builder->CreateCall(calleeFunction, argumentValue, "calltmp");
+    // for expr always returns 0.
+    return IntArithmetic ? (Value *)ConstantInt::get(Type::getInt64Ty(*TheContext), 0)
+                         : ConstantFP::get(*TheContext, APFloat(0.0));
 }
 
 Function *ASTProtoExpr::codegen() {
@@ -367,58 +1290,528 @@ Function *ASTProtoExpr::codegen() {
 }
 
 Function *ASTFunctionExpr::codegen() {
-    // First, check for an existing function from a previous 'extern' declaration.
-    Function *func = TheModule->getFunction(this->prototype->getName());
+    // Every definition goes into a module of its own, so an earlier definition is not in
+    // the current module: look for it among the definitions handed to the JIT.
+    std::string name = this->prototype->getName();
+    Function *func = TheModule->getFunction(name);
+    if (FunctionDefinitions.count(name) || (func && !func->empty())) {
+        // function is already defined elsewhere
+        return (Function*)LogErrorV("Function cannot be redefined.");
+    }
 
-    if (!func){
-        // there is no existing function definition or extern function with the same name
+    // There is no existing function definition or extern function with the same name
+    if (!func) {
         func = this->prototype->codegen();
     }
 
-    if (!func) {
+    if (!this->codegenBody(func, type_double)) {
+        // Error reading body, remove function.
+        func->eraseFromParent();
         return nullptr;
     }
 
-    if (!func->empty()){
-        // function is already defined elsewhere
-        return (Function*)LogErrorV("Function cannot be redefined.");
-    }
+    // Remember the prototype so later modules can declare this function
+    FunctionProtos[name] = std::make_unique<ASTProtoExpr>(*this->prototype);
+    return func;
+}
 
+bool ASTFunctionExpr::codegenBody(Function *func, ValueType returnType) {
     // Create a new basic block to start insertion into.
     // A basic block is a control block, think of code enclosed by {} in c
-    // Since we don't have control flow (if statement) support for now, we only have a single block
     BasicBlock *basicBlock = BasicBlock::Create(*TheContext, "entry", func);
+
+    // Self tail calls jump back to this block instead of calling the function again, so
+    // the arguments are phis merging the real arguments with those of the tail calls.
+    // Without tail calls the optimizer folds it back into the entry block.
+    BasicBlock *tailRecurseBlock = BasicBlock::Create(*TheContext, "tailrecurse", func);
     
     // Set the builder insertion point to the basic block
     // This way it adds new instructions to the basic block 
     Builder->SetInsertPoint(basicBlock);
+    Builder->setFastMathFlags(applyFastMathPolicy(this->prototype->getFastMathPolicy(), func));
+    Builder->CreateBr(tailRecurseBlock);
+    Builder->SetInsertPoint(tailRecurseBlock);
 
     // Need to clear the NamedValue map since we enter a new function
     // TODO what about global variables?
     NamedValues.clear();
+    TailRecurseArguments.clear();
+    OverflowBlock = nullptr;
     for (auto &arg : func->args()){
+        PHINode *argument = Builder->CreatePHI(arg.getType(), 2, arg.getName());
+        argument->addIncoming(&arg, basicBlock);
+        TailRecurseArguments.push_back(argument);
         // Record the function arguments in the NamedValues map.
-        NamedValues[std::string(arg.getName())] = &arg;
+        NamedValues[std::string(arg.getName())] = argument;
     }
+    TailRecurseBlock = tailRecurseBlock;
+    std::vector<PHINode *> arguments = TailRecurseArguments;
+
+    // Int arithmetic leaving the exact range evaluates the function again, which must not
+    // call an extern a second time
+    bool intArithmetic = IntArithmetic;
+    IntArithmetic = IntArithmetic && !this->callsExtern();
+    Value *returnValue = this->body->codegen();
+    TailRecurseBlock = nullptr;
+    if (!returnValue) {
+        IntArithmetic = intArithmetic;
+        return false;
+    }
+    if (getValueType(returnValue) > returnType) {
+        IntArithmetic = intArithmetic;
+        LogErrorV("Function result does not match its inferred type");
+        return false;
+    }
+
+    // Finish off the function.
+    Builder->CreateRet(convertValue(returnValue, returnType));
+
+    bool overflowHandled = !OverflowBlock || this->codegenOverflow(func, arguments, returnType);
+    IntArithmetic = intArithmetic;
+    if (!overflowHandled) {
+        return false;
+    }
+
+    // Validate the generated code, checking for consistency.
+    verifyFunction(*func);
 
-    if (Value *returnValue = this->body->codegen()) {
-        // Finish off the function.
-        Builder->CreateRet(returnValue);
+    // Optimize the function.
+    TheFPM->run(*func);
 
-        // Validate the generated code, checking for consistency.
-        verifyFunction(*func);
+    return true;
+}
+
+/** @brief Generate the body of a function in the middle of generating another one, whose
+ *  state is restored afterwards
+ */
+static bool codegenNestedBody(ASTFunctionExpr &definition, Function *func, ValueType returnType,
+                              bool intArithmetic) {
+    std::map<std::string, Value *> callerNamedValues = NamedValues;
+    BasicBlock *callerTailRecurseBlock = TailRecurseBlock;
+    std::vector<PHINode *> callerTailRecurseArguments = TailRecurseArguments;
+    BasicBlock *callerOverflowBlock = OverflowBlock;
+    bool callerIntArithmetic = IntArithmetic;
+    bool generated;
+    {
+        IRBuilderBase::InsertPointGuard insertPointGuard(*Builder);
+        IRBuilderBase::FastMathFlagGuard fastMathGuard(*Builder);
+        IntArithmetic = intArithmetic;
+        generated = definition.codegenBody(func, returnType);
+    }
+    NamedValues = callerNamedValues;
+    TailRecurseBlock = callerTailRecurseBlock;
+    TailRecurseArguments = callerTailRecurseArguments;
+    OverflowBlock = callerOverflowBlock;
+    IntArithmetic = callerIntArithmetic;
+    return generated;
+}
 
+Function *ASTFunctionExpr::codegenSpecialization(const std::vector<ValueType> &argTypes) {
+    std::string name = specializationName(this->getName(), argTypes);
+    if (Function *func = TheModule->getFunction(name)) {
         return func;
-    }  
-    // Error reading body, remove function.
-    func->eraseFromParent();
-    return nullptr;
+    }
+
+    ValueType returnType = this->inferReturnType(argTypes);
+    auto declare = [&](GlobalValue::LinkageTypes linkage) {
+        std::vector<Type *> llvmArgTypes;
+        for (ValueType type : argTypes) {
+            llvmArgTypes.push_back(getLLVMType(type));
+        }
+        FunctionType *functionType =
+            FunctionType::get(getLLVMType(returnType), llvmArgTypes, false);
+        Function *func = Function::Create(functionType, linkage, name, TheModule.get());
+        unsigned index = 0;
+        for (auto &arg : func->args()) {
+            arg.setName(this->prototype->getArgs()[index++]);
+        }
+        return func;
+    };
+    if (this->publishedSpecializations.count(argTypes)) {
+        return declare(Function::ExternalLinkage);
+    }
+
+    // Without a JIT to publish to the module gets a private copy, in the module of
+    // specializations the ones it calls are published along with it
+    if (!TheJIT || InSpecializationModule) {
+        Function *func = declare(TheJIT ? Function::ExternalLinkage : Function::InternalLinkage);
+
+        // The specialization is generated in the middle of the function that calls it
+        if (!codegenNestedBody(*this, func, returnType, true)) {
+            func->eraseFromParent();
+            return nullptr;
+        }
+        return func;
+    }
+
+    // Generate it into a module of its own, leaving the one in progress alone
+    std::unique_ptr<LLVMContext> callerContext = std::move(TheContext);
+    std::unique_ptr<Module> callerModule = std::move(TheModule);
+    std::unique_ptr<IRBuilder<>> callerBuilder = std::move(Builder);
+    std::unique_ptr<legacy::FunctionPassManager> callerFPM = std::move(TheFPM);
+    initializeModule();
+    InSpecializationModule = true;
+    Function *generated = this->codegenSpecialization(argTypes);
+    InSpecializationModule = false;
+
+    std::vector<std::string> names;
+    for (Function &func : *TheModule) {
+        if (!func.isDeclaration()) {
+            names.push_back(func.getName().str());
+        }
+    }
+    TheFPM.reset();
+    Builder.reset();
+    ThreadSafeModule module(std::move(TheModule), std::move(TheContext));
+
+    TheContext = std::move(callerContext);
+    TheModule = std::move(callerModule);
+    Builder = std::move(callerBuilder);
+    TheFPM = std::move(callerFPM);
+
+    if (!generated) {
+        return nullptr;
+    }
+    if (Error error = TheJIT->addModule(std::move(module))) {
+        LogErrorV(toString(std::move(error)).c_str());
+        return nullptr;
+    }
+    for (const std::string &published : names) {
+        std::vector<ValueType> publishedArgTypes;
+        if (ASTFunctionExpr *definition = findSpecialization(published, publishedArgTypes)) {
+            definition->publishedSpecializations.insert(publishedArgTypes);
+        }
+    }
+    return declare(Function::ExternalLinkage);
 }
 
-void setupParser() {
+Function *ASTFunctionExpr::codegenDoubleVariant() {
+    std::string name = this->getName() + ".double";
+    if (Function *func = TheModule->getFunction(name)) {
+        return func;
+    }
+
+    std::vector<Type *> argTypes(this->getArgs().size(), Type::getDoubleTy(*TheContext));
+    FunctionType *functionType =
+        FunctionType::get(Type::getDoubleTy(*TheContext), argTypes, false);
+    Function *func =
+        Function::Create(functionType, Function::InternalLinkage, name, TheModule.get());
+    unsigned index = 0;
+    for (auto &arg : func->args()) {
+        arg.setName(this->prototype->getArgs()[index++]);
+    }
+
+    if (!codegenNestedBody(*this, func, type_double, false)) {
+        func->eraseFromParent();
+        return nullptr;
+    }
+    return func;
+}
+
+bool ASTFunctionExpr::codegenOverflow(Function *func, const std::vector<PHINode *> &arguments,
+                                      ValueType returnType) {
+    // A specialization falls back to the generic function, which has int arithmetic only
+    // where numbers are written as integers and falls back to the double variant itself
+    bool generic = returnType == type_double;
+    for (auto &arg : func->args()) {
+        generic = generic && getValueType(arg.getType()) == type_double;
+    }
+    if (generic && func->arg_empty()) {
+        // Without arguments there is no tail recursion to keep, so a top-level expression
+        // is evaluated again in doubles right here rather than in a function of its own,
+        // which would double the functions compiled for every expression
+        Builder->SetInsertPoint(OverflowBlock);
+        OverflowBlock = nullptr;
+        bool intArithmetic = IntArithmetic;
+        IntArithmetic = false;
+        Value *result = this->body->codegen();
+        IntArithmetic = intArithmetic;
+        if (!result) {
+            return false;
+        }
+        Builder->CreateRet(convertValue(result, type_double));
+        return true;
+    }
+
+    Function *fallback = generic ? this->codegenDoubleVariant() : getFunction(this->getName());
+    if (!fallback) {
+        return false;
+    }
+
+    // Start again from the arguments of the current (tail recursive) call, calls made before
+    // the overflow are made again, which is only unobservable because none calls an extern
+    Builder->SetInsertPoint(OverflowBlock);
+    Builder->setFastMathFlags(FastMathFlags());
+    std::vector<Value *> doubleArguments;
+    for (PHINode *argument : arguments) {
+        doubleArguments.push_back(convertValue(argument, type_double));
+    }
+    Value *result = Builder->CreateCall(fallback, doubleArguments, "fallback");
+
+    switch (returnType) {
+    case type_bool:
+        result = Builder->CreateFCmpONE(result, ConstantFP::get(*TheContext, APFloat(0.0)));
+        break;
+    case type_int:
+        result = Builder->CreateSelect(
+            createIsExactInt(result), Builder->CreateFPToSI(result, getLLVMType(type_int)),
+            ConstantInt::get(getLLVMType(type_int), OverflowResult, true));
+        break;
+    default:
+        break;
+    }
+    Builder->CreateRet(result);
+    OverflowBlock = nullptr;
+    return true;
+}
+
+void optimizeModule(Module &module, KaleidoscopeJIT &jit, int inlineThreshold) {
+    TargetMachine &targetMachine = jit.getTargetMachine();
+    TargetLibraryInfoImpl libraryInfo(targetMachine.getTargetTriple());
+    if (jit.hasVectorMathLibrary()) {
+        libraryInfo.addVectorizableFunctionsFromVecLib(TargetLibraryInfoImpl::LIBMVEC_X86);
+    }
+
+    legacy::PassManager modulePasses;
+    modulePasses.add(createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+    modulePasses.add(new TargetLibraryInfoWrapperPass(libraryInfo));
+
+    PassManagerBuilder passBuilder;
+    passBuilder.OptLevel = 3;
+    passBuilder.Inliner = createFunctionInliningPass(inlineThreshold);
+    passBuilder.LoopVectorize = true;
+    passBuilder.SLPVectorize = true;
+    passBuilder.populateModulePassManager(modulePasses);
+
+    modulePasses.run(module);
+}
+
+Function *ASTFunctionExpr::codegenBatch() {
+    // Keep the copy out of the JIT's symbol table, the real definition lives in its own module
+    Function *func = this->prototype->codegen();
+    func->setLinkage(GlobalValue::InternalLinkage);
+    if (!this->codegenBody(func, type_double)) {
+        func->eraseFromParent();
+        return nullptr;
+    }
+    func->addFnAttr(Attribute::AlwaysInline);
+
+    Type *doubleType = Type::getDoubleTy(*TheContext);
+    Type *int64Type = Type::getInt64Ty(*TheContext);
+    FunctionType *batchType = FunctionType::get(
+        Type::getVoidTy(*TheContext),
+        {doubleType->getPointerTo(), doubleType->getPointerTo(), int64Type}, false);
+    Function *batch = Function::Create(batchType, Function::ExternalLinkage,
+                                       func->getName() + ".batch", TheModule.get());
+    Argument *results = batch->getArg(0);
+    Argument *arguments = batch->getArg(1);
+    Argument *count = batch->getArg(2);
+    results->setName("results");
+    arguments->setName("arguments");
+    count->setName("count");
+    // Results never overlap the arguments, so the vectorizer needs no runtime checks
+    batch->addParamAttr(0, Attribute::NoAlias);
+    batch->addParamAttr(1, Attribute::NoAlias);
+
+    BasicBlock *entryBlock = BasicBlock::Create(*TheContext, "entry", batch);
+    BasicBlock *loopBlock = BasicBlock::Create(*TheContext, "loop", batch);
+    BasicBlock *exitBlock = BasicBlock::Create(*TheContext, "exit", batch);
+
+    // for (i = 0; i < count; i++) results[i] = func(arguments[i], arguments[count + i], ...)
+    Builder->SetInsertPoint(entryBlock);
+    Value *isEmpty = Builder->CreateICmpSLE(count, ConstantInt::get(int64Type, 0), "isempty");
+    Builder->CreateCondBr(isEmpty, exitBlock, loopBlock);
+
+    Builder->SetInsertPoint(loopBlock);
+    PHINode *index = Builder->CreatePHI(int64Type, 2, "i");
+    index->addIncoming(ConstantInt::get(int64Type, 0), entryBlock);
+
+    std::vector<Value *> argumentValues;
+    for (unsigned j = 0; j < func->arg_size(); j++) {
+        Value *column = Builder->CreateMul(count, ConstantInt::get(int64Type, j), "column");
+        Value *offset = Builder->CreateAdd(column, index, "offset");
+        Value *address = Builder->CreateGEP(doubleType, arguments, offset, "argaddr");
+        argumentValues.push_back(Builder->CreateLoad(doubleType, address, "arg"));
+    }
+    Value *result = Builder->CreateCall(func, argumentValues, "result");
+    Builder->CreateStore(result, Builder->CreateGEP(doubleType, results, index, "resultaddr"));
+
+    Value *next = Builder->CreateAdd(index, ConstantInt::get(int64Type, 1), "next");
+    index->addIncoming(next, loopBlock);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(next, count, "loopcond"), loopBlock, exitBlock);
+
+    Builder->SetInsertPoint(exitBlock);
+    Builder->CreateRetVoid();
+
+    verifyFunction(*batch);
+    // Inline the evaluated function into the batch loop, then vectorize the loop
+    optimizeModule(*TheModule, *TheJIT);
+    return batch;
+}
+
+Function *ASTFunctionExpr::codegenReoptimized(const std::string &name,
+                                              const std::vector<ArgumentExpectation> &expectations) {
+    Function *generic = getFunction(this->getName());
+    if (!generic || generic->arg_size() != expectations.size()) {
+        return nullptr;
+    }
+
+    // Integral and integral constant arguments are passed to the int specialization, if the
+    // function can have one
+    std::vector<ValueType> argTypes;
+    bool guarded = false;
+    bool specializable = !this->callsExtern();
+    for (const ArgumentExpectation &expectation : expectations) {
+        bool integral = expectation.constant ? isIntegral(expectation.value) : expectation.integral;
+        integral = integral && specializable;
+        argTypes.push_back(integral ? type_int : type_double);
+        guarded = guarded || integral || expectation.constant;
+    }
+    Function *expected = generic;
+    if (std::find(argTypes.begin(), argTypes.end(), type_int) != argTypes.end()) {
+        expected = this->codegenSpecialization(argTypes);
+        if (!expected) {
+            return nullptr;
+        }
+    }
+
+    Function *func =
+        Function::Create(generic->getFunctionType(), Function::ExternalLinkage, name, TheModule.get());
+    BasicBlock *entryBlock = BasicBlock::Create(*TheContext, "entry", func);
+    Builder->SetInsertPoint(entryBlock);
+    Builder->setFastMathFlags(FastMathFlags());
+    std::vector<Value *> arguments;
+    for (auto &arg : func->args()) {
+        arg.setName(generic->getArg(arguments.size())->getName());
+        arguments.push_back(&arg);
+    }
+
+    if (guarded) {
+        // Check that the arguments have the values seen by profiling
+        Value *guard = Builder->getTrue();
+        for (unsigned i = 0, e = arguments.size(); i != e; ++i) {
+            Value *arg = arguments[i];
+            if (expectations[i].constant) {
+                // Compared bit for bit, 0.0 == -0.0 but they are different arguments
+                Type *bitsType = Type::getInt64Ty(*TheContext);
+                Value *value = ConstantFP::get(*TheContext, APFloat(expectations[i].value));
+                guard = Builder->CreateAnd(
+                    guard, Builder->CreateICmpEQ(Builder->CreateBitCast(arg, bitsType),
+                                                 Builder->CreateBitCast(value, bitsType),
+                                                 "isconstant"));
+            } else if (argTypes[i] == type_int) {
+                // Int arguments have to be exact, like every other int value
+                guard = Builder->CreateAnd(guard, createIsExactInt(arg));
+            }
+        }
+        BasicBlock *expectedBlock = BasicBlock::Create(*TheContext, "expected", func);
+        BasicBlock *fallbackBlock = BasicBlock::Create(*TheContext, "fallback", func);
+        Builder->CreateCondBr(guard, expectedBlock, fallbackBlock,
+                              MDBuilder(*TheContext).createBranchWeights(1000, 1));
+
+        Builder->SetInsertPoint(expectedBlock);
+        std::vector<Value *> expectedArguments;
+        for (unsigned i = 0, e = arguments.size(); i != e; ++i) {
+            Type *type = expected->getArg(i)->getType();
+            if (expectations[i].constant) {
+                expectedArguments.push_back(
+                    argTypes[i] == type_int
+                        ? ConstantInt::get(type, (int64_t)expectations[i].value, true)
+                        : ConstantFP::get(type, expectations[i].value));
+            } else if (argTypes[i] == type_int) {
+                expectedArguments.push_back(Builder->CreateFPToSI(arguments[i], type));
+            } else {
+                expectedArguments.push_back(arguments[i]);
+            }
+        }
+        Value *result = Builder->CreateCall(expected, expectedArguments, "calltmp");
+        if (getValueType(result) == type_int) {
+            // The int result was not exact, the generic function computes it as a double
+            BasicBlock *exactBlock = BasicBlock::Create(*TheContext, "exact", func);
+            Value *overflowed = Builder->CreateICmpEQ(
+                result, ConstantInt::get(result->getType(), OverflowResult, true), "overflowed");
+            Builder->CreateCondBr(overflowed, fallbackBlock, exactBlock,
+                                  MDBuilder(*TheContext).createBranchWeights(1, 1000));
+            Builder->SetInsertPoint(exactBlock);
+        }
+        Builder->CreateRet(convertValue(result, type_double));
+
+        Builder->SetInsertPoint(fallbackBlock);
+    }
+    Builder->CreateRet(Builder->CreateCall(generic, arguments, "calltmp"));
+
+    verifyFunction(*func);
+    return func;
+}
+
+void defineCalledFunctions(size_t limit) {
+    size_t defined = 0;
+    bool changed = true;
+    while (changed && defined < limit) {
+        changed = false;
+        std::vector<Function *> declarations;
+        for (Function &func : *TheModule) {
+            if (func.isDeclaration()) {
+                declarations.push_back(&func);
+            }
+        }
+
+        // Copies may call other definitions, which are copied in the next round
+        for (Function *func : declarations) {
+            ASTFunctionExpr *definition = nullptr;
+            ValueType returnType = type_double;
+            std::vector<ValueType> argTypes;
+            auto definitionIt = FunctionDefinitions.find(func->getName().str());
+            if (definitionIt != FunctionDefinitions.end()) {
+                definition = definitionIt->second.get();
+            } else if ((definition = findSpecialization(func->getName().str(), argTypes))) {
+                returnType = getValueType(func->getReturnType());
+            }
+            if (!definition || defined == limit) {
+                continue;
+            }
+            func->setLinkage(GlobalValue::InternalLinkage);
+            if (!definition->codegenBody(func, returnType)) {
+                // Leave it to the JIT to resolve, deleting the body makes it external again
+                func->deleteBody();
+                continue;
+            }
+            defined++;
+            changed = true;
+        }
+    }
+}
+
+void initializeModule() {
+    // A module that was not handed to the JIT has to go before the context it lives in
+    TheFPM.reset();
+    Builder.reset();
+    TheModule.reset();
+
     TheContext = std::make_unique<LLVMContext>();
     TheModule = std::make_unique<Module>("interpreter module", *TheContext);
+    if (TheJIT) {
+        TheModule->setDataLayout(TheJIT->getDataLayout());
+    }
 
     // Create a new builder for the module.
     Builder = std::make_unique<IRBuilder<>>(*TheContext);
+
+    // Create a new pass manager attached to it.
+    TheFPM = std::make_unique<legacy::FunctionPassManager>(TheModule.get());
+    // Do simple "peephole" optimizations and bit-twiddling optzns.
+    TheFPM->add(createInstructionCombiningPass());
+    // Reassociate expressions, only where the fast-math flags allow it.
+    TheFPM->add(createReassociatePass());
+    // Eliminate Common SubExpressions.
+    TheFPM->add(createGVNPass());
+    // Drop checks of int arithmetic that conditions already prove to stay in range.
+    TheFPM->add(createCorrelatedValuePropagationPass());
+    // Simplify the control flow graph (deleting unreachable blocks, etc).
+    TheFPM->add(createCFGSimplificationPass());
+    TheFPM->doInitialization();
+}
+
+void setupParser() {
+    initializeModule();
 }
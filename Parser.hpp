@@ -8,6 +8,8 @@
  *      VariableExpr
  *      BinaryExpr
  *      CallExpr   
+ *      IfExpr          if/then/else
+ *      ForExpr         for/in loop
  * 
  *      FunctionExpr   def + top level expression
  *      ProtoExpr      extern
@@ -18,8 +20,10 @@
 
 #include <string>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <map>
+#include <set>
 #include <iostream>
 
 #include "llvm/ADT/APFloat.h"
@@ -29,18 +33,89 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 
+#include "JIT.hpp"
+
 using namespace std;
 using namespace llvm;
 
+/* Floating point semantics a function is compiled with, each level allows more than the last
+ *      strict      IEEE 754, every operation is rounded exactly as written
+ *      contract    a*b + c may become one fused multiply-add, which rounds once instead of
+ *                  twice, so results can differ in the last bit
+ *      reassoc     operations may be reassociated ((a+b)+c => a+(b+c)) and divisions turned
+ *                  into multiplications by the reciprocal, which can change results noticeably
+ *                  when values of very different magnitude are added
+ *      fast        additionally assumes no NaNs, infinities or signed zeros ever occur
+ * fastmath_module means a function follows DefaultFastMathPolicy.
+ */
+enum FastMathPolicy {
+    fastmath_module = 0,
+    fastmath_strict = 1,
+    fastmath_contract = 2,
+    fastmath_reassoc = 3,
+    fastmath_fast = 4
+};
+
+/* Policy of functions without an annotation, strict unless changed on the command line */
+extern FastMathPolicy DefaultFastMathPolicy;
+
+/* Types type inference can prove for a value, ordered so the join of two types is the larger
+ *      type_unknown    nothing is known yet, e.g. a recursive call whose type is being inferred;
+ *                      a function that never returns is inferred and generated as double
+ *      type_bool       0 or 1, the result of a comparison, generated as i1
+ *      type_int        an integral number, generated as i64
+ *      type_double     any number, generated as double
+ * Every function is generated with double arguments and result. Calls with bool or int
+ * arguments use a specialized variant of the callee, generated with i64 arguments.
+ * Int values are kept between -2^53 and 2^53, where double arithmetic on integers is exact,
+ * so int arithmetic computes the same results as double arithmetic. A function whose int
+ * arithmetic leaves that range, or multiplies into a zero double arithmetic would make -0,
+ * computes its result again with double arithmetic. Functions that call externs other than
+ * the math builtins only have double arithmetic, so computing again calls none twice.
+ */
+enum ValueType {
+    type_unknown = 0,
+    type_bool = 1,
+    type_int = 2,
+    type_double = 3
+};
+
+/* Types of the variables in scope */
+typedef std::map<std::string, ValueType> TypeEnv;
+
+/* What profiling saw of one argument of a function, which a re-optimized version of the
+ * function is specialized for (see ASTFunctionExpr::codegenReoptimized)
+ *      integral    every value was an integer, so the int specialization can be called
+ *      constant    (nearly) every value was `value`
+ */
+struct ArgumentExpectation {
+    bool integral = false;
+    bool constant = false;
+    double value = 0;
+};
+
+/** @brief Look up a fast-math policy by its name (strict, contract, reassoc or fast)
+ *  @return true if the name is a valid policy, which is stored in `policy`
+ */
+bool parseFastMathPolicy(const std::string &name, FastMathPolicy &policy);
+
 extern std::unique_ptr<LLVMContext> TheContext;
 extern std::unique_ptr<IRBuilder<>> Builder;
 extern std::unique_ptr<Module> TheModule;
 extern std::map<std::string, Value *> NamedValues;
+extern std::unique_ptr<legacy::FunctionPassManager> TheFPM;
+extern std::unique_ptr<KaleidoscopeJIT> TheJIT;
+
+/* Held while generating code into the globals above when another thread may do the same,
+ * i.e. while the re-optimizer is running (see Reoptimizer.hpp). Not held while running
+ * compiled code. */
+extern std::mutex CompilerMutex;
 
 static void printIndentation(int level){
     for(int i = 0; i < level; i++) {
@@ -59,6 +134,22 @@ public:
     }
 
     virtual Value *codegen() = 0;
+
+    /** @brief Infer the type of the value the expression evaluates to
+     *  @param env types of the variables in scope
+     */
+    virtual ValueType inferType(const TypeEnv &env) {
+        return type_double;
+    }
+
+    /* Called on the expression whose value a function returns, see ASTCallExpr */
+    virtual void markTailPosition() {}
+
+    /* Whether evaluating the expression may call an extern other than the math builtins,
+     * directly or from a called definition */
+    virtual bool callsExtern() {
+        return false;
+    }
 };
 
 /* Number Expression */
@@ -72,6 +163,8 @@ public:
         std::cout << "Number(" << to_string(value) << ")" << std::endl;
     }
 
+    ValueType inferType(const TypeEnv &env) override;
+
     Value *codegen() override;
 };
 
@@ -86,6 +179,8 @@ public:
         std::cout << "Variable(" << identifier << ")" << std::endl;
     }
 
+    ValueType inferType(const TypeEnv &env) override;
+
     Value *codegen() override;
 };
 
@@ -113,6 +208,12 @@ public:
         RHS->debugMessage(level + 1);
     }
 
+    bool callsExtern() override {
+        return LHS->callsExtern() || RHS->callsExtern();
+    }
+
+    ValueType inferType(const TypeEnv &env) override;
+
     Value *codegen() override;
 };
 
@@ -120,8 +221,11 @@ public:
 class ASTProtoExpr : public ASTBaseExpr {
     string name;
     vector<string> args;
+    FastMathPolicy fastMath = fastmath_module;
+    bool isExtern = false;
 public:
     ASTProtoExpr(string name, vector<string> args) : name(std::move(name)), args(std::move(args)) {};
+    ASTProtoExpr(const ASTProtoExpr &) = default;
 
     void debugMessage(int level) override {
         printIndentation(level);
@@ -129,13 +233,38 @@ public:
         for(auto &arg: args){
             std::cout << arg << ", ";
         }
-        std::cout << ")" << std::endl;
+        std::cout << ")";
+        if (fastMath != fastmath_module) {
+            std::cout << " FastMath(" << fastMath << ")";
+        }
+        std::cout << std::endl;
     }
 
     string getName() {
         return name;
     }
 
+    const vector<string> &getArgs() {
+        return args;
+    }
+
+    FastMathPolicy getFastMathPolicy() {
+        return fastMath;
+    }
+
+    void setFastMathPolicy(FastMathPolicy policy) {
+        fastMath = policy;
+    }
+
+    /* Whether this prototype comes from an extern, i.e. the function is defined elsewhere */
+    bool getIsExtern() {
+        return isExtern;
+    }
+
+    void setIsExtern(bool value) {
+        isExtern = value;
+    }
+
     Function *codegen() override;
 };
 
@@ -143,9 +272,16 @@ public:
 class ASTFunctionExpr : public ASTBaseExpr {
     unique_ptr<ASTProtoExpr> prototype;
     unique_ptr<ASTBaseExpr> body;
+    map<vector<ValueType>, ValueType> inferredReturnTypes;
+    set<vector<ValueType>> publishedSpecializations;
+    bool profiled = false;
+    bool callsExternKnown = false;
+    bool callsExternResult = false;
 public:
     ASTFunctionExpr(unique_ptr<ASTProtoExpr> prototype, unique_ptr<ASTBaseExpr> body)
-    : prototype(std::move(prototype)), body(std::move(body)) {};
+    : prototype(std::move(prototype)), body(std::move(body)) {
+        this->body->markTailPosition();
+    };
 
     void debugMessage(int level) override {
         printIndentation(level);
@@ -154,13 +290,93 @@ public:
         body->debugMessage(level + 1);
     }
 
+    string getName() {
+        return prototype->getName();
+    }
+
+    const vector<string> &getArgs() {
+        return prototype->getArgs();
+    }
+
+    /* Called by the re-optimizer on the functions it profiles, see SpecializeProfiledCalls */
+    void setProfiled() {
+        profiled = true;
+    }
+
+    bool isProfiled() {
+        return profiled;
+    }
+
+    /** @brief Whether the body may call an extern other than the math builtins
+     *  Int arithmetic that leaves the exact range evaluates the function again with doubles,
+     *  so only functions that cannot call one
+     *  get int arithmetic and specializations.
+     */
+    bool callsExtern() override;
+
+    /** @brief Infer the result type of the function for the given argument types
+     */
+    ValueType inferReturnType(const vector<ValueType> &argTypes);
+
     Function *codegen() override;
+
+    /** @brief Generate the body of `func` (the generic function, a copy of it or a
+     *  specialization), whose arguments have the types to generate the body for
+     *  @return false if the body contains an error
+     */
+    bool codegenBody(Function *func, ValueType returnType);
+
+    /** @brief Declare the variant of the function specialized for bool or int arguments in
+     *  the current module, generating it if it is not there yet
+     *  Specializations are generated once, into a module of their own that is added to the
+     *  JIT for good, so every caller calls the same one and profilers see it by name;
+     *  defineCalledFunctions() copies them in to inline them. Without a JIT the module gets
+     *  a private copy. Bool arguments are passed as int, so argTypes only holds type_int and
+     *  type_double.
+     */
+    Function *codegenSpecialization(const vector<ValueType> &argTypes);
+
+    /** @brief Get `name.double`, the function generated with double arithmetic only, in the
+     *  current module, generating it as a private function if it is not there yet
+     */
+    Function *codegenDoubleVariant();
+
+    /** @brief Fill in OverflowBlock of `func`, which computes the result again with double
+     *  arithmetic from the current arguments, in `func` itself if it has none
+     *  @return false if the fallback cannot be generated
+     */
+    bool codegenOverflow(Function *func, const vector<PHINode *> &arguments,
+                         ValueType returnType);
+
+    /** @brief Generate `void name.batch(double *results, double *arguments, i64 count)`, which
+     *  evaluates the function for `count` sets of arguments, and optimize it into SIMD code
+     *  Argument j of evaluation i is read from arguments[j * count + i]. The function body is
+     *  generated again as a private copy in the current module so it can be inlined, and
+     *  calls to math builtins are bound to libmvec's vector functions when it is available
+     *  (x86-64 only). Only the embedding API generates batch functions.
+     */
+    Function *codegenBatch();
+
+    /** @brief Generate `double name(double...)`, which runs the function specialized for the
+     *  argument values profiling saw when the arguments have them and the generic function
+     *  otherwise; integral arguments call the int specialization, constant ones are passed
+     *  as constants so the optimizer can propagate them once the callee is inlined. The int
+     *  specialization gives the same results as the generic function, an int result that is
+     *  not exact is computed again by the generic function.
+     *  The generic function is only declared, see defineCalledFunctions().
+     */
+    Function *codegenReoptimized(const string &name, const vector<ArgumentExpectation> &expectations);
 };
 
-/* Function Call Expression */
+/* Function Call Expression
+ * A call whose value is returned by the calling function is in tail position. Such a call to
+ * the calling function itself is compiled into a jump back to the start of the function, so
+ * tail recursion runs as a loop in constant stack space.
+ */
 class ASTCallExpr : public ASTBaseExpr {
     string callee;
     vector<unique_ptr<ASTBaseExpr>> arguments;
+    bool isTailCall = false;
 public:
     ASTCallExpr(string callee, vector<unique_ptr<ASTBaseExpr>> arguments)
     : callee(std::move(callee)), arguments(std::move(arguments)) {};
@@ -173,9 +389,105 @@ public:
         }
     }
 
+    void markTailPosition() override {
+        isTailCall = true;
+    }
+
+    bool callsExtern() override;
+
+    ValueType inferType(const TypeEnv &env) override;
+
     Value *codegen() override;
 };
 
+/* If Expression, evaluates to the value of the branch taken */
+class ASTIfExpr : public ASTBaseExpr {
+    unique_ptr<ASTBaseExpr> condition;
+    unique_ptr<ASTBaseExpr> thenExpr;
+    unique_ptr<ASTBaseExpr> elseExpr;
+public:
+    ASTIfExpr(unique_ptr<ASTBaseExpr> condition, unique_ptr<ASTBaseExpr> thenExpr,
+              unique_ptr<ASTBaseExpr> elseExpr)
+    : condition(std::move(condition)), thenExpr(std::move(thenExpr)),
+      elseExpr(std::move(elseExpr)) {};
+
+    void debugMessage(int level) override {
+        printIndentation(level);
+        std::cout << "If" << std::endl;
+        condition->debugMessage(level + 1);
+
+        printIndentation(level);
+        std::cout << "Then" << std::endl;
+        thenExpr->debugMessage(level + 1);
+
+        printIndentation(level);
+        std::cout << "Else" << std::endl;
+        elseExpr->debugMessage(level + 1);
+    }
+
+    // Whichever branch is taken provides the value of the if
+    void markTailPosition() override {
+        thenExpr->markTailPosition();
+        elseExpr->markTailPosition();
+    }
+
+    bool callsExtern() override {
+        return condition->callsExtern() || thenExpr->callsExtern() || elseExpr->callsExtern();
+    }
+
+    ValueType inferType(const TypeEnv &env) override;
+
+    Value *codegen() override;
+};
+
+/* For Expression, runs the body until the end condition is false and evaluates to 0 */
+class ASTForExpr : public ASTBaseExpr {
+    string varName;
+    unique_ptr<ASTBaseExpr> start;
+    unique_ptr<ASTBaseExpr> end;
+    unique_ptr<ASTBaseExpr> step;
+    unique_ptr<ASTBaseExpr> body;
+public:
+    ASTForExpr(string varName, unique_ptr<ASTBaseExpr> start, unique_ptr<ASTBaseExpr> end,
+               unique_ptr<ASTBaseExpr> step, unique_ptr<ASTBaseExpr> body)
+    : varName(std::move(varName)), start(std::move(start)), end(std::move(end)),
+      step(std::move(step)), body(std::move(body)) {};
+
+    void debugMessage(int level) override {
+        printIndentation(level);
+        std::cout << "For(" << varName << ")" << std::endl;
+        start->debugMessage(level + 1);
+        end->debugMessage(level + 1);
+        if (step) {
+            step->debugMessage(level + 1);
+        }
+
+        printIndentation(level);
+        std::cout << "Body" << std::endl;
+        body->debugMessage(level + 1);
+    }
+
+    bool callsExtern() override {
+        return start->callsExtern() || end->callsExtern() || (step && step->callsExtern()) ||
+               body->callsExtern();
+    }
+
+    ValueType inferType(const TypeEnv &env) override;
+
+    Value *codegen() override;
+};
+
+/* Prototypes of every function seen so far, used to declare them in later modules */
+extern std::map<std::string, std::unique_ptr<ASTProtoExpr>> FunctionProtos;
+
+/* Every function definition compiled so far, used to generate specialized variants */
+extern std::map<std::string, std::unique_ptr<ASTFunctionExpr>> FunctionDefinitions;
+
+/* Whether calls with int arguments to functions the re-optimizer profiles call specialized
+ * variants; otherwise they call the generic function, so the profile of the callee sees
+ * them, and only its re-optimized code calls the specialization */
+extern bool SpecializeProfiledCalls;
+
 void setOperatorPrecedence();
 
 /** @brief Parser helper function to parse a function definition
@@ -189,11 +501,40 @@ std::unique_ptr<ASTFunctionExpr> parseDefinition();
 std::unique_ptr<ASTProtoExpr> parseExtern();
 
 /** @brief Parser helper function to parse a top level expression
+ *  @param name name of the anonymous function evaluating the expression
  *  @return Expression that represents a top level expression
  */
-std::unique_ptr<ASTFunctionExpr> parseTopLevelExpression();
+std::unique_ptr<ASTFunctionExpr> parseTopLevelExpression(const std::string &name = "__anon_expr");
+
+/* Message of the most recent parse or code generation error */
+extern std::string LastError;
 
 // Function to setup parser 
 void setupParser();
 
+/** @brief Start a fresh module (and context) for the next definition or expression
+ *  The previous module has to be handed over to the JIT before calling this.
+ */
+void initializeModule();
+
+/** @brief Define the functions and specializations the current module calls but only
+ *  declares as private copies of their definitions, and those the copies call, so the
+ *  optimizer can inline them
+ *  @param limit most definitions to copy, calls to the others stay calls into the JIT
+ */
+void defineCalledFunctions(size_t limit);
+
+/** @brief Optimize a module at O3, including inlining, loop unrolling and vectorization
+ *  Math builtins in vectorized loops are bound to libmvec if it is available.
+ *  @param jit the JIT the module is compiled by, whose target the cost models describe
+ *  @param inlineThreshold cost up to which calls are inlined, LLVM's O3 default is 250
+ */
+void optimizeModule(Module &module, KaleidoscopeJIT &jit, int inlineThreshold = 250);
+
+/** @brief Look up a function in the current module, declaring it from FunctionProtos if
+ *  it was defined in an earlier module
+ *  @return the function, or nullptr if it has never been declared
+ */
+Function *getFunction(const std::string &name);
+
 #endif
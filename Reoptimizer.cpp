@@ -0,0 +1,412 @@
+
+#include <atomic>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <pthread.h>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "Parser.hpp"
+#include "Reoptimizer.hpp"
+
+/* Instrumented code samples the arguments of one call in this many, a power of two */
+static const uint64_t SampleInterval = 16;
+
+/* An argument is constant if at least 90% of at least this many samples had one value */
+static const uint64_t MinConstantSamples = 8;
+
+/* Most definitions copied into a re-optimized module for inlining */
+static const size_t MaxCopiedDefinitions = 32;
+
+/* Inlining threshold of re-optimized modules, LLVM's O3 default is 250 */
+static const int ReoptimizedInlineThreshold = 1000;
+
+struct ArgumentProfile {
+    uint64_t samples = 0;
+    uint64_t integralSamples = 0;
+    double firstValue = 0;
+    uint64_t firstValueSamples = 0;
+};
+
+enum ProfileTier {
+    tier_instrumented = 0,
+    tier_queued,
+    tier_optimized,
+    tier_failed
+};
+
+struct FunctionProfile {
+    std::string name;
+    Reoptimizer *owner = nullptr;
+    /* Incremented by the instrumented code through its address, see instrument() */
+    std::atomic<uint64_t> calls{0};
+
+    /* Guards the members below, which are updated by calls on any thread */
+    std::mutex mutex;
+    std::vector<ArgumentProfile> arguments;
+    ProfileTier tier = tier_instrumented;
+
+    std::vector<ArgumentExpectation> getExpectations() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<ArgumentExpectation> expectations(arguments.size());
+        for (size_t i = 0; i < arguments.size(); i++) {
+            const ArgumentProfile &argument = arguments[i];
+            if (argument.samples == 0) {
+                continue;
+            }
+            expectations[i].integral = argument.integralSamples == argument.samples;
+            expectations[i].constant = argument.samples >= MinConstantSamples &&
+                                       argument.firstValueSamples * 10 >= argument.samples * 9;
+            expectations[i].value = argument.firstValue;
+        }
+        return expectations;
+    }
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t),
+              "instrumented code updates call counters as plain 64 bit integers");
+
+std::unique_ptr<Reoptimizer> TheReoptimizer;
+
+Reoptimizer::Reoptimizer(KaleidoscopeJIT &jit, const ReoptimizerOptions &options)
+    : jit(jit), options(options) {
+    thread = std::thread(&Reoptimizer::run, this);
+}
+
+Reoptimizer::~Reoptimizer() {
+    stop();
+}
+
+void Reoptimizer::recordSample(FunctionProfile *profile, const double *arguments) {
+    std::lock_guard<std::mutex> lock(profile->mutex);
+    for (size_t i = 0; i < profile->arguments.size(); i++) {
+        ArgumentProfile &argument = profile->arguments[i];
+        double value = arguments[i];
+        if (argument.samples == 0) {
+            argument.firstValue = value;
+        }
+        argument.samples++;
+        if (value == std::trunc(value) && std::fabs(value) < 9007199254740992.0 &&
+            !(value == 0 && std::signbit(value))) {
+            argument.integralSamples++;
+        }
+        if (value == argument.firstValue &&
+            std::signbit(value) == std::signbit(argument.firstValue)) {
+            argument.firstValueSamples++;
+        }
+    }
+
+    if (profile->tier == tier_instrumented && profile->calls >= profile->owner->options.hotThreshold) {
+        profile->tier = tier_queued;
+        profile->owner->enqueue(profile);
+    }
+}
+
+void Reoptimizer::enqueue(FunctionProfile *profile) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (stopping) {
+            return;
+        }
+        queue.push_back(profile);
+    }
+    queueChanged.notify_all();
+}
+
+void Reoptimizer::instrument(Function *func) {
+    std::string name = func->getName().str();
+    std::unique_ptr<FunctionProfile> &profile = profiles[name];
+    if (!profile) {
+        profile = std::make_unique<FunctionProfile>();
+        profile->name = name;
+    }
+    profile->owner = this;
+    if (profile->arguments.size() != func->arg_size()) {
+        // A loaded profile of a function with the same name but other arguments is useless
+        profile->arguments.assign(func->arg_size(), ArgumentProfile());
+        profile->calls = 0;
+    }
+
+    // entry:   count = load calls, store count + 1 to calls
+    //          br (count % SampleInterval == 0), sample, body
+    // sample:  store the arguments, call recordSample(profile, arguments)
+    // body:    the function as generated
+    LLVMContext &context = func->getContext();
+    BasicBlock *entryBlock = &func->getEntryBlock();
+    BasicBlock *bodyBlock = entryBlock->splitBasicBlock(entryBlock->begin(), "body");
+    entryBlock->getTerminator()->eraseFromParent();
+    BasicBlock *sampleBlock = BasicBlock::Create(context, "sample", func, bodyBlock);
+
+    IRBuilder<> builder(entryBlock);
+    Type *int64Type = builder.getInt64Ty();
+    Type *doubleType = builder.getDoubleTy();
+    Value *arguments = builder.CreateAlloca(doubleType, builder.getInt32(func->arg_size()),
+                                            "profiledargs");
+    Value *callsAddress = builder.CreateIntToPtr(
+        builder.getInt64((uint64_t)(uintptr_t)&profile->calls), int64Type->getPointerTo());
+    // Relaxed loads and stores rather than an atomic add, which costs more than a small
+    // function; calls racing on other threads can lose counts, which does not matter here
+    LoadInst *count = builder.CreateLoad(int64Type, callsAddress, "calls");
+    count->setAtomic(AtomicOrdering::Monotonic);
+    count->setAlignment(Align(8));
+    StoreInst *increment = builder.CreateStore(builder.CreateAdd(count, builder.getInt64(1)),
+                                               callsAddress);
+    increment->setAtomic(AtomicOrdering::Monotonic);
+    increment->setAlignment(Align(8));
+    Value *sampled = builder.CreateICmpEQ(
+        builder.CreateAnd(count, builder.getInt64(SampleInterval - 1)), builder.getInt64(0),
+        "sampled");
+    builder.CreateCondBr(sampled, sampleBlock, bodyBlock,
+                         MDBuilder(context).createBranchWeights(1, SampleInterval - 1));
+
+    builder.SetInsertPoint(sampleBlock);
+    for (auto &arg : func->args()) {
+        builder.CreateStore(&arg, builder.CreateConstGEP1_32(doubleType, arguments, arg.getArgNo()));
+    }
+    Type *voidPointerType = builder.getInt8PtrTy();
+    FunctionType *recordType = FunctionType::get(
+        builder.getVoidTy(), {voidPointerType, doubleType->getPointerTo()}, false);
+    Value *record = builder.CreateIntToPtr(
+        builder.getInt64((uint64_t)(uintptr_t)&Reoptimizer::recordSample),
+        recordType->getPointerTo());
+    Value *profileAddress = builder.CreateIntToPtr(
+        builder.getInt64((uint64_t)(uintptr_t)profile.get()), voidPointerType);
+    builder.CreateCall(recordType, record, {profileAddress, arguments});
+    builder.CreateBr(bodyBlock);
+
+    // The stub takes the name, see publish()
+    func->setName(name + ".tier0");
+}
+
+Error Reoptimizer::publish(const std::string &name) {
+    auto profileIt = profiles.find(name);
+    if (profileIt == profiles.end()) {
+        return createStringError(inconvertibleErrorCode(), "%s was not instrumented",
+                                 name.c_str());
+    }
+    FunctionProfile &profile = *profileIt->second;
+
+    // Calls with int arguments go through the stub too, so the profile sees them
+    auto definitionIt = FunctionDefinitions.find(name);
+    if (definitionIt != FunctionDefinitions.end()) {
+        definitionIt->second->setProfiled();
+    }
+
+    if (profile.calls >= options.hotThreshold) {
+        // Hot in an earlier run, skip the instrumented code
+        Expected<ThreadSafeModule> module = generateModule(profile);
+        if (!module) {
+            return module.takeError();
+        }
+        Expected<JITTargetAddress> address = compileModule(profile, std::move(*module));
+        if (!address) {
+            return address.takeError();
+        }
+        profile.tier = tier_optimized;
+        return jit.addStub(name, *address);
+    }
+
+    Expected<JITEvaluatedSymbol> instrumented = jit.lookup(name + ".tier0");
+    if (!instrumented) {
+        return instrumented.takeError();
+    }
+    return jit.addStub(name, instrumented->getAddress());
+}
+
+Expected<ThreadSafeModule> Reoptimizer::generateModule(FunctionProfile &profile) {
+    auto definitionIt = FunctionDefinitions.find(profile.name);
+    if (definitionIt == FunctionDefinitions.end()) {
+        return createStringError(inconvertibleErrorCode(), "%s has no definition",
+                                 profile.name.c_str());
+    }
+
+    // Generate into a module of our own, leaving the one in progress alone
+    std::unique_ptr<LLVMContext> savedContext = std::move(TheContext);
+    std::unique_ptr<Module> savedModule = std::move(TheModule);
+    std::unique_ptr<IRBuilder<>> savedBuilder = std::move(Builder);
+    std::unique_ptr<legacy::FunctionPassManager> savedFPM = std::move(TheFPM);
+    initializeModule();
+    SpecializeProfiledCalls = true;
+
+    Function *func = definitionIt->second->codegenReoptimized(profile.name + ".opt",
+                                                              profile.getExpectations());
+    if (func) {
+        defineCalledFunctions(MaxCopiedDefinitions);
+    }
+    SpecializeProfiledCalls = false;
+    TheFPM.reset();
+    Builder.reset();
+    ThreadSafeModule module(std::move(TheModule), std::move(TheContext));
+
+    TheContext = std::move(savedContext);
+    TheModule = std::move(savedModule);
+    Builder = std::move(savedBuilder);
+    TheFPM = std::move(savedFPM);
+
+    if (!func) {
+        return createStringError(inconvertibleErrorCode(), "Unable to generate %s.opt: %s",
+                                 profile.name.c_str(), LastError.c_str());
+    }
+    return std::move(module);
+}
+
+Expected<JITTargetAddress> Reoptimizer::compileModule(FunctionProfile &profile,
+                                                      ThreadSafeModule module) {
+    module.withModuleDo(
+        [this](Module &module) { optimizeModule(module, jit, ReoptimizedInlineThreshold); });
+    if (Error error = jit.addModule(std::move(module))) {
+        return std::move(error);
+    }
+    Expected<JITEvaluatedSymbol> symbol = jit.lookup(profile.name + ".opt");
+    if (!symbol) {
+        return symbol.takeError();
+    }
+    return symbol->getAddress();
+}
+
+void Reoptimizer::run() {
+    // Signals are for the threads of the interpreter to handle
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    for (;;) {
+        FunctionProfile *profile;
+        {
+            std::unique_lock<std::mutex> lock(queueMutex);
+            queueChanged.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) {
+                return;
+            }
+            profile = queue.front();
+            queue.pop_front();
+            busy = true;
+        }
+
+        Expected<JITTargetAddress> address = [&]() -> Expected<JITTargetAddress> {
+            Expected<ThreadSafeModule> module = [&]() {
+                std::lock_guard<std::mutex> lock(CompilerMutex);
+                return generateModule(*profile);
+            }();
+            if (!module) {
+                return module.takeError();
+            }
+            // Optimizing and compiling, the expensive part, runs without holding the lock
+            return compileModule(*profile, std::move(*module));
+        }();
+        Error error = address ? jit.redirectStub(profile->name, *address) : address.takeError();
+
+        std::lock_guard<std::mutex> profileLock(profile->mutex);
+        if (error) {
+            profile->tier = tier_failed;
+            std::cerr << "Unable to re-optimize " << profile->name << ": "
+                      << toString(std::move(error)) << std::endl;
+        } else {
+            profile->tier = tier_optimized;
+            std::cerr << "Re-optimized " << profile->name << " after " << profile->calls
+                      << " calls" << std::endl;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            busy = false;
+        }
+        queueChanged.notify_all();
+    }
+}
+
+void Reoptimizer::waitUntilIdle() {
+    std::unique_lock<std::mutex> lock(queueMutex);
+    queueChanged.wait(lock, [this]() { return stopping || (queue.empty() && !busy); });
+}
+
+/*
+ * Profile files have one line per function:
+ *      <name> <calls> <arguments> followed by, for every argument,
+ *      <samples> <integral samples> <first value> <first value samples>
+ */
+
+Error Reoptimizer::loadProfiles() {
+    if (options.profilePath.empty()) {
+        return Error::success();
+    }
+    std::ifstream file(options.profilePath);
+    if (!file) {
+        // Nothing profiled yet
+        return Error::success();
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        auto profile = std::make_unique<FunctionProfile>();
+        uint64_t calls = 0;
+        size_t arguments = 0;
+        fields >> profile->name >> calls >> arguments;
+        profile->calls = calls;
+        profile->arguments.resize(arguments);
+        for (ArgumentProfile &argument : profile->arguments) {
+            // Read with strtod, which unlike >> accepts the nan and inf printf writes
+            std::string firstValue;
+            fields >> argument.samples >> argument.integralSamples >> firstValue >>
+                argument.firstValueSamples;
+            argument.firstValue = strtod(firstValue.c_str(), nullptr);
+        }
+        if (!fields) {
+            return createStringError(inconvertibleErrorCode(), "%s: malformed profile: %s",
+                                     options.profilePath.c_str(), line.c_str());
+        }
+        profiles[profile->name] = std::move(profile);
+    }
+    return Error::success();
+}
+
+void Reoptimizer::stop() {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex);
+        if (stopping) {
+            return;
+        }
+        stopping = true;
+    }
+    queueChanged.notify_all();
+    thread.join();
+}
+
+Error Reoptimizer::dumpProfiles() {
+    if (options.profilePath.empty()) {
+        return Error::success();
+    }
+    FILE *file = fopen(options.profilePath.c_str(), "w");
+    if (!file) {
+        return createStringError(std::error_code(errno, std::generic_category()), "%s",
+                                 options.profilePath.c_str());
+    }
+    fprintf(file, "# Kaleidoscope profile: name calls arguments, then for every argument:"
+                  " samples integral-samples first-value first-value-samples\n");
+    for (auto &entry : profiles) {
+        FunctionProfile &profile = *entry.second;
+        std::lock_guard<std::mutex> lock(profile.mutex);
+        fprintf(file, "%s %llu %zu", profile.name.c_str(), (unsigned long long)profile.calls,
+                profile.arguments.size());
+        for (const ArgumentProfile &argument : profile.arguments) {
+            fprintf(file, " %llu %llu %.17g %llu", (unsigned long long)argument.samples,
+                    (unsigned long long)argument.integralSamples, argument.firstValue,
+                    (unsigned long long)argument.firstValueSamples);
+        }
+        fprintf(file, "\n");
+    }
+    if (fclose(file) != 0) {
+        return createStringError(std::error_code(errno, std::generic_category()), "%s",
+                                 options.profilePath.c_str());
+    }
+    return Error::success();
+}
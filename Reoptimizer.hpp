@@ -0,0 +1,108 @@
+/*
+ **************************************** Re-optimizer ****************************************
+ * Tiered compilation of function definitions, driven by profiles of their calls.
+ *
+ * A definition is first compiled as `name.tier0` with cheap instrumentation at its entry:
+ * a call counter, and every 16th call a sample of its argument values (whether
+ * they are integers, and whether they keep the same value). Calls to `name` go through a
+ * JIT stub pointing at the instrumented code. Calls with int arguments call the generic
+ * function too (see SpecializeProfiledCalls), so the profile sees them.
+ *
+ * Once a function has been called hotThreshold times, a background thread generates
+ * `name.opt` from the function's AST: a guard checks that the arguments have the values
+ * the profile saw and, if so, calls the int specialization with the constant arguments
+ * substituted, otherwise the generic function. The definitions it calls are copied into
+ * the same module so they can be inlined, and the module is optimized at O3 with a high
+ * inlining threshold before the stub is redirected to `name.opt`. Calls already running
+ * finish in the instrumented code.
+ *
+ * Profiles can be written to a file and loaded on the next run: a definition whose
+ * loaded profile is already hot is compiled optimized right away, without warming up.
+ */
+
+#ifndef REOPTIMIZER_H_
+#define REOPTIMIZER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "llvm/IR/Function.h"
+#include "JIT.hpp"
+
+struct ReoptimizerOptions {
+    /* Calls after which a function is re-optimized */
+    uint64_t hotThreshold = 10000;
+    /* Profiles are loaded from this file and written back by dumpProfiles(), none if empty */
+    std::string profilePath;
+};
+
+struct FunctionProfile;
+
+class Reoptimizer {
+    KaleidoscopeJIT &jit;
+    ReoptimizerOptions options;
+    /* Profiles by function name, guarded by CompilerMutex */
+    std::map<std::string, std::unique_ptr<FunctionProfile>> profiles;
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<FunctionProfile *> queue;
+    bool busy = false;
+    bool stopping = false;
+    std::thread thread;
+
+    /* Called by instrumented code every 16th call, with the arguments of the call */
+    static void recordSample(FunctionProfile *profile, const double *arguments);
+    void enqueue(FunctionProfile *profile);
+    void run();
+    /* Generate name.opt into a new module, CompilerMutex must be held */
+    Expected<ThreadSafeModule> generateModule(FunctionProfile &profile);
+    /* Optimize and compile the module generated for a profile */
+    Expected<JITTargetAddress> compileModule(FunctionProfile &profile, ThreadSafeModule module);
+
+public:
+    Reoptimizer(KaleidoscopeJIT &jit, const ReoptimizerOptions &options);
+    ~Reoptimizer();
+
+    /** @brief Load the profiles from options.profilePath, a missing file is not an error
+     */
+    Error loadProfiles();
+
+    /** @brief Add the instrumentation to a definition generated into TheModule and rename it
+     *  to name.tier0; call before handing the module to the JIT
+     */
+    void instrument(Function *func);
+
+    /** @brief Define the stub through which `name` is called, after the module holding the
+     *  instrumented definition was added to the JIT and the definition to FunctionDefinitions
+     *  Compiles the optimized version right away if the loaded profile is already hot. Calls
+     *  compiled from then on, int arguments or not, go through the stub.
+     *  CompilerMutex must be held.
+     */
+    Error publish(const std::string &name);
+
+    /** @brief Wait until every hot function found so far has been re-optimized
+     */
+    void waitUntilIdle();
+
+    /** @brief Stop re-optimizing, functions still waiting are left as they are
+     *  CompilerMutex must not be held, re-optimizing a function needs it.
+     */
+    void stop();
+
+    /** @brief Write the profiles to options.profilePath, if there is one
+     *  CompilerMutex must be held, or no other thread may be generating code.
+     */
+    Error dumpProfiles();
+};
+
+/* Re-optimizer of the interpreter, null unless tiered compilation was asked for */
+extern std::unique_ptr<Reoptimizer> TheReoptimizer;
+
+#endif
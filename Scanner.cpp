@@ -7,20 +7,21 @@ string identifierStr;
 double numVal;
 int currToken;
 
-/// gettok - Return the next token from standard input.
-static int gettok() {
-    static int LastChar = ' ';
+static FILE *scannerInput = stdin;
+static int LastChar = ' ';
 
+/// gettok - Return the next token from the scanner input.
+static int gettok() {
     // Skip any whitespace.
     while (isspace(LastChar)){
-        LastChar = getchar();
+        LastChar = getc(scannerInput);
     }
 
     // Check if it's identifier, identifier starts with [a-zA-Z]
     // identifier: [a-zA-Z][a-zA-Z0-9]*
     if (isalpha(LastChar)) {
         identifierStr = LastChar;
-        while (isalnum((LastChar = getchar()))){
+        while (isalnum((LastChar = getc(scannerInput)))){
             identifierStr += LastChar;
         }
         // Check special characters
@@ -28,6 +29,16 @@ static int gettok() {
             return token_def;
         if (identifierStr == "extern")
             return token_extern;
+        if (identifierStr == "if")
+            return token_if;
+        if (identifierStr == "then")
+            return token_then;
+        if (identifierStr == "else")
+            return token_else;
+        if (identifierStr == "for")
+            return token_for;
+        if (identifierStr == "in")
+            return token_in;
         
         return token_identifier;
     }
@@ -37,7 +48,7 @@ static int gettok() {
         std::string NumStr;
         do {
             NumStr += LastChar;
-            LastChar = getchar();
+            LastChar = getc(scannerInput);
         } while (isdigit(LastChar) || LastChar == '.');
 
         numVal = strtod(NumStr.c_str(), nullptr);
@@ -47,7 +58,7 @@ static int gettok() {
     // Skip over comments
     if (LastChar == '#') {
         do
-            LastChar = getchar();
+            LastChar = getc(scannerInput);
         while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
         // Process whatever is behind the comment
@@ -62,10 +73,15 @@ static int gettok() {
     // Otherwise, just return the character as its ascii value.
     // We use this for special characters like parenthesis and operators
     int ThisChar = LastChar;
-    LastChar = getchar();
+    LastChar = getc(scannerInput);
     return ThisChar;
 }
 
+void setScannerInput(FILE *input) {
+  scannerInput = input;
+  LastChar = ' ';
+}
+
 int getNextToken() {
   return currToken = gettok();
 }
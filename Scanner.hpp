@@ -6,6 +6,7 @@
 #ifndef SCANNER_H_
 #define SCANNER_H_
 
+#include <cstdio>
 #include <string>
 
 using namespace std;
@@ -15,7 +16,12 @@ enum Token {
     token_extern = 1,
     token_def = 2,
     token_identifier = 3,
-    token_num = 4
+    token_num = 4,
+    token_if = 5,
+    token_then = 6,
+    token_else = 7,
+    token_for = 8,
+    token_in = 9
 };
 
 /* Scanner values */
@@ -23,9 +29,14 @@ extern string identifierStr;
 extern double numVal;
 extern int currToken;
 
-/** @brief Scanner helper function to get token from stdin
- *  @return the next token from standard input
+/** @brief Scanner helper function to get token from the scanner input
+ *  @return the next token from the scanner input, standard input by default
  */
 int getNextToken();
 
+/** @brief Make the scanner read from another stream and forget any lookahead character
+ *  @param input stream to read tokens from, not owned by the scanner
+ */
+void setScannerInput(FILE *input);
+
 #endif 
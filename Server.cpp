@@ -0,0 +1,510 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Parser.hpp"
+#include "Reoptimizer.hpp"
+#include "Scanner.hpp"
+#include "Server.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+/* A statement read from a client, answered by whichever thread finishes it */
+struct Request {
+    std::string statement;
+    Clock::time_point received;
+    std::promise<std::string> response;
+};
+
+/* Module holding the compiled expressions of one batch, freed once all of them ran unless
+ * one of them is kept compiled for later requests */
+struct EvaluationBatch {
+    ResourceTrackerSP tracker;
+    std::atomic<size_t> pending{0};
+    bool cached = false;
+};
+
+/* An expression generated into the module of the current batch, waiting to be compiled */
+struct Evaluation {
+    std::shared_ptr<Request> request;
+    std::unique_ptr<ASTFunctionExpr> expression;
+};
+
+/* An expression kept compiled, by the text of its statement */
+struct CompiledExpression {
+    double (*function)();
+    std::shared_ptr<EvaluationBatch> batch;
+};
+
+/* Most expressions kept compiled. Functions cannot be redefined, so a compiled expression
+ * stays valid for the life of the server. */
+static const size_t MaxCompiledExpressions = 4096;
+
+template <typename T>
+class BlockingQueue {
+    std::mutex mutex;
+    std::condition_variable available;
+    std::deque<T> items;
+
+public:
+    void push(T item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            items.push_back(std::move(item));
+        }
+        available.notify_one();
+    }
+
+    /** @brief Wait for an item and take it along with the ones queued behind it
+     *  @param max most items to take
+     */
+    std::vector<T> popBatch(size_t max) {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this]() { return !items.empty(); });
+        std::vector<T> batch;
+        while (!items.empty() && batch.size() < max) {
+            batch.push_back(std::move(items.front()));
+            items.pop_front();
+        }
+        return batch;
+    }
+};
+
+/** @brief Answer a request, the latency is measured up to this point
+ *  @param status "ok" or "error"
+ */
+static void respond(Request &request, const char *status, const std::string &payload) {
+    std::chrono::duration<double, std::micro> latency = Clock::now() - request.received;
+    char latencyText[32];
+    snprintf(latencyText, sizeof(latencyText), "%.1f", latency.count());
+    request.response.set_value(std::string(status) + " " + latencyText + " " + payload + "\n");
+}
+
+class EvaluationServer {
+    const ServerOptions &options;
+    BlockingQueue<std::shared_ptr<Request>> requests;
+    BlockingQueue<std::function<void()>> tasks;
+
+    /* Expressions of the current batch generated into TheModule */
+    std::vector<Evaluation> evaluations;
+    std::list<std::shared_ptr<EvaluationBatch>> batches;
+    std::map<std::string, CompiledExpression> compiledExpressions;
+    size_t evaluationCount = 0;
+
+    void compileRequest(const std::shared_ptr<Request> &request);
+    void compileDefinition(Request &request);
+    void compileExtern(Request &request);
+    void compileEvaluation(const std::shared_ptr<Request> &request);
+    void flushEvaluations();
+    bool compileEvaluations(std::vector<Evaluation> &compiled);
+    void evaluate(const std::shared_ptr<Request> &request, double (*function)(),
+                  const std::shared_ptr<EvaluationBatch> &batch);
+    void releaseFinishedBatches();
+
+    void compileLoop() {
+        for (;;) {
+            std::vector<std::shared_ptr<Request>> batch = requests.popBatch(options.maxBatch);
+            std::lock_guard<std::mutex> lock(CompilerMutex);
+            for (auto &request : batch) {
+                compileRequest(request);
+            }
+            flushEvaluations();
+            releaseFinishedBatches();
+        }
+    }
+
+    void workerLoop() {
+        for (;;) {
+            for (auto &task : tasks.popBatch(1)) {
+                task();
+            }
+        }
+    }
+
+public:
+    explicit EvaluationServer(const ServerOptions &options) : options(options) {}
+
+    void start() {
+        unsigned workers = options.workers;
+        if (workers == 0) {
+            workers = std::max(1u, std::thread::hardware_concurrency());
+        }
+        // The threads run until the process exits
+        std::thread(&EvaluationServer::compileLoop, this).detach();
+        for (unsigned i = 0; i < workers; i++) {
+            std::thread(&EvaluationServer::workerLoop, this).detach();
+        }
+    }
+
+    void submit(std::shared_ptr<Request> request) {
+        requests.push(std::move(request));
+    }
+};
+
+void EvaluationServer::compileRequest(const std::shared_ptr<Request> &request) {
+    const std::string &statement = request->statement;
+    if (std::all_of(statement.begin(), statement.end(), [](char c) { return isspace(c); })) {
+        respond(*request, "error", "Empty request");
+        return;
+    }
+
+    FILE *input = fmemopen((void *)statement.data(), statement.size(), "r");
+    if (!input) {
+        respond(*request, "error", strerror(errno));
+        return;
+    }
+    setScannerInput(input);
+    getNextToken();
+    LastError.clear();
+
+    switch (currToken) {
+    case token_def:
+        // Definitions may be called by the expressions after them, which are compiled
+        // into later modules, so the earlier expressions are compiled first
+        flushEvaluations();
+        compileDefinition(*request);
+        break;
+    case token_extern:
+        flushEvaluations();
+        compileExtern(*request);
+        break;
+    default:
+        compileEvaluation(request);
+        break;
+    }
+    fclose(input);
+}
+
+/** @brief Check that the statement parsed was the whole request
+ */
+static bool parsedWholeStatement(Request &request) {
+    if (currToken == ';') {
+        getNextToken();
+    }
+    if (currToken != token_eof) {
+        respond(request, "error", "Expected a single statement per request");
+        return false;
+    }
+    return true;
+}
+
+void EvaluationServer::compileDefinition(Request &request) {
+    auto definition = parseDefinition();
+    if (!definition) {
+        respond(request, "error", LastError);
+        return;
+    }
+    if (!parsedWholeStatement(request)) {
+        return;
+    }
+    std::string name = definition->getName();
+    Function *func = definition->codegen();
+    if (!func) {
+        respond(request, "error", LastError);
+        return;
+    }
+    if (TheReoptimizer) {
+        TheReoptimizer->instrument(func);
+    }
+
+    Error error = TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext)));
+    initializeModule();
+    if (error) {
+        respond(request, "error", toString(std::move(error)));
+        return;
+    }
+    FunctionDefinitions[name] = std::move(definition);
+    if (TheReoptimizer) {
+        error = TheReoptimizer->publish(name);
+    } else {
+        // Compile it now rather than when an expression first calls it
+        auto symbol = TheJIT->lookup(name);
+        error = symbol ? Error::success() : symbol.takeError();
+    }
+    if (error) {
+        respond(request, "error", toString(std::move(error)));
+        return;
+    }
+    respond(request, "ok", name);
+}
+
+void EvaluationServer::compileExtern(Request &request) {
+    auto externProto = parseExtern();
+    if (!externProto) {
+        respond(request, "error", LastError);
+        return;
+    }
+    if (!parsedWholeStatement(request)) {
+        return;
+    }
+    if (!externProto->codegen()) {
+        respond(request, "error", LastError);
+        return;
+    }
+    std::string name = externProto->getName();
+    FunctionProtos[name] = std::move(externProto);
+    respond(request, "ok", name);
+}
+
+void EvaluationServer::compileEvaluation(const std::shared_ptr<Request> &request) {
+    auto compiled = compiledExpressions.find(request->statement);
+    if (compiled != compiledExpressions.end()) {
+        evaluate(request, compiled->second.function, compiled->second.batch);
+        return;
+    }
+
+    std::string name = "__eval_" + std::to_string(evaluationCount++);
+    auto expression = parseTopLevelExpression(name);
+    if (!expression) {
+        respond(*request, "error", LastError);
+        return;
+    }
+    if (!parsedWholeStatement(*request)) {
+        return;
+    }
+    Function *func = expression->codegen();
+    // Nothing else calls the expression, so later modules need not declare it
+    FunctionProtos.erase(name);
+    if (!func) {
+        respond(*request, "error", LastError);
+        return;
+    }
+    evaluations.push_back({request, std::move(expression)});
+}
+
+void EvaluationServer::flushEvaluations() {
+    if (evaluations.empty()) {
+        return;
+    }
+    std::vector<Evaluation> flushed;
+    flushed.swap(evaluations);
+    if (compileEvaluations(flushed) || flushed.size() == 1) {
+        return;
+    }
+
+    // One expression failed to link, e.g. it calls an extern that does not exist, which
+    // fails the whole module. Compile every expression in a module of its own, so only the
+    // requests that are wrong fail.
+    for (auto &evaluation : flushed) {
+        Function *func = evaluation.expression->codegen();
+        FunctionProtos.erase(evaluation.expression->getName());
+        if (!func) {
+            respond(*evaluation.request, "error", LastError);
+            continue;
+        }
+        std::vector<Evaluation> single;
+        single.push_back(std::move(evaluation));
+        compileEvaluations(single);
+    }
+}
+
+/** @brief Compile the expressions generated into TheModule and call them
+ *  @return false if the module failed to compile and there were several expressions in it,
+ *  which are not answered then
+ */
+bool EvaluationServer::compileEvaluations(std::vector<Evaluation> &compiled) {
+    auto batch = std::make_shared<EvaluationBatch>();
+    batch->tracker = TheJIT->getMainJITDylib().createResourceTracker();
+    Error error = TheJIT->addModule(
+        ThreadSafeModule(std::move(TheModule), std::move(TheContext)), batch->tracker);
+    initializeModule();
+    if (error) {
+        std::string message = toString(std::move(error));
+        for (auto &evaluation : compiled) {
+            respond(*evaluation.request, "error", message);
+        }
+        return true;
+    }
+
+    // The first lookup compiles the whole module
+    auto first = TheJIT->lookup(compiled.front().expression->getName());
+    if (!first && compiled.size() > 1) {
+        consumeError(first.takeError());
+        if (Error error = batch->tracker->remove()) {
+            std::cerr << "Unable to free failed expressions: " << toString(std::move(error))
+                      << std::endl;
+        }
+        return false;
+    }
+
+    batches.push_back(batch);
+    for (size_t i = 0; i < compiled.size(); i++) {
+        std::shared_ptr<Request> request = compiled[i].request;
+        auto symbol = i == 0 ? std::move(first) : TheJIT->lookup(compiled[i].expression->getName());
+        if (!symbol) {
+            respond(*request, "error", toString(symbol.takeError()));
+            continue;
+        }
+        auto function = (double (*)())(intptr_t)symbol->getAddress();
+        if (compiledExpressions.size() < MaxCompiledExpressions) {
+            compiledExpressions[request->statement] = {function, batch};
+            batch->cached = true;
+        }
+        evaluate(request, function, batch);
+    }
+    return true;
+}
+
+/** @brief Call a compiled expression on a worker thread
+ */
+void EvaluationServer::evaluate(const std::shared_ptr<Request> &request, double (*function)(),
+                                const std::shared_ptr<EvaluationBatch> &batch) {
+    batch->pending++;
+    tasks.push([function, request, batch]() {
+        char result[32];
+        snprintf(result, sizeof(result), "%.17g", function());
+        respond(*request, "ok", result);
+        batch->pending--;
+    });
+}
+
+void EvaluationServer::releaseFinishedBatches() {
+    for (auto it = batches.begin(); it != batches.end();) {
+        if ((*it)->pending != 0 || (*it)->cached) {
+            ++it;
+            continue;
+        }
+        if (Error error = (*it)->tracker->remove()) {
+            std::cerr << "Unable to free evaluated expressions: " << toString(std::move(error))
+                      << std::endl;
+        }
+        it = batches.erase(it);
+    }
+}
+
+/*
+ * Connections
+ */
+
+static bool sendAll(int socketFd, const std::string &data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t count = send(socketFd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+/** @brief Answer the requests of one client, one at a time, until it disconnects
+ */
+static void serveConnection(int socketFd, EvaluationServer &server) {
+    std::string buffer;
+    char chunk[4096];
+    for (;;) {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == std::string::npos) {
+            ssize_t count = recv(socketFd, chunk, sizeof(chunk), 0);
+            if (count <= 0) {
+                close(socketFd);
+                return;
+            }
+            buffer.append(chunk, count);
+        }
+
+        auto request = std::make_shared<Request>();
+        request->received = Clock::now();
+        request->statement = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        std::future<std::string> response = request->response.get_future();
+        server.submit(std::move(request));
+        if (!sendAll(socketFd, response.get())) {
+            break;
+        }
+    }
+    close(socketFd);
+}
+
+static char SocketPath[sizeof(sockaddr_un::sun_path)];
+
+/** @brief Wait for SIGINT or SIGTERM, which every other thread blocks, then write the
+ *  profiles, remove the socket and exit
+ */
+static void handleExitSignals(sigset_t signals) {
+    int signal;
+    sigwait(&signals, &signal);
+    unlink(SocketPath);
+    if (TheReoptimizer) {
+        TheReoptimizer->stop();
+        // Keep the compiler thread from generating code while the profiles are written
+        CompilerMutex.lock();
+        if (Error error = TheReoptimizer->dumpProfiles()) {
+            std::cerr << "Unable to write profiles: " << toString(std::move(error)) << std::endl;
+        }
+    }
+    _exit(0);
+}
+
+int runServer(const ServerOptions &options) {
+    if (options.socketPath.empty() || options.socketPath.size() >= sizeof(SocketPath)) {
+        std::cerr << "Invalid socket path " << options.socketPath << std::endl;
+        return 1;
+    }
+    strcpy(SocketPath, options.socketPath.c_str());
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        perror("socket");
+        return 1;
+    }
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SocketPath);
+    // A socket left behind by a previous server that did not exit cleanly
+    unlink(SocketPath);
+    if (bind(listenFd, (sockaddr *)&address, sizeof(address)) < 0 || listen(listenFd, 128) < 0) {
+        perror(SocketPath);
+        close(listenFd);
+        return 1;
+    }
+
+    // Threads started from here on inherit the blocked signals
+    sigset_t exitSignals;
+    sigemptyset(&exitSignals);
+    sigaddset(&exitSignals, SIGINT);
+    sigaddset(&exitSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &exitSignals, nullptr);
+    std::thread(handleExitSignals, exitSignals).detach();
+
+    EvaluationServer server(options);
+    server.start();
+    std::cerr << "Listening on " << SocketPath << std::endl;
+
+    for (;;) {
+        int socketFd = accept(listenFd, nullptr, nullptr);
+        if (socketFd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept");
+            break;
+        }
+        std::thread(serveConnection, socketFd, std::ref(server)).detach();
+    }
+    close(listenFd);
+    unlink(SocketPath);
+    return 1;
+}
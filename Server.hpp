@@ -0,0 +1,43 @@
+/*
+ **************************************** Server ****************************************
+ * Evaluation daemon that keeps compiled functions resident between requests.
+ * Clients connect to a Unix domain socket and send one statement per line, each answered
+ * by one line before the next statement is read:
+ *      def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2)   ->  ok 812.4 fib
+ *      extern sin(x)                                           ->  ok 35.1 sin
+ *      fib(20) + sin(1)                                        ->  ok 1502.9 6765.8414709848
+ *      fib(                                                    ->  error 20.3 <message>
+ * The second field is the latency of the request in microseconds, measured in the server
+ * from reading the statement to having its response.
+ *
+ * A single compiler thread owns the parser and the JIT. It takes every request queued
+ * since its last batch (up to maxBatch), compiles definitions as they come and compiles
+ * the expressions of the batch together into one module, so they share the cost of
+ * running the JIT. The compiled expressions are then called on the worker threads while
+ * the next batch is being compiled. An expression that fails to link (e.g. it calls an
+ * extern that does not exist) fails the module of its batch, whose expressions are then
+ * compiled one module each so the others still succeed. Compiled expressions are kept by
+ * the text of their statement, so sending the same statement again only costs calling it.
+ */
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+#include <cstddef>
+#include <string>
+
+struct ServerOptions {
+    std::string socketPath;
+    /* Threads calling compiled expressions, one per hardware thread if 0 */
+    unsigned workers = 0;
+    /* Most requests compiled together */
+    size_t maxBatch = 64;
+};
+
+/** @brief Serve requests on options.socketPath until the process is interrupted
+ *  The parser and the JIT have to be set up before calling this.
+ *  @return exit status, non zero if the socket could not be set up
+ */
+int runServer(const ServerOptions &options);
+
+#endif
@@ -0,0 +1,543 @@
+/*
+ * Benchmarks for the scanner, parser, code generator and JIT
+ *
+ * Build and run (the benchmark is always compiled with -O3):
+ *      cmake --build . --target bench && ./bench --label $(git rev-parse --short HEAD)
+ *
+ * Results are written as JSON (to stdout or --output <file>) so runs on different commits
+ * can be compared; a human readable summary goes to stderr. Every benchmark is repeated
+ * and the fastest repetition is reported.
+ *
+ *      scan        tokens/sec for getNextToken()
+ *      parse       AST nodes/sec for parseDefinition()
+ *      codegen     functions/sec for ASTFunctionExpr::codegen()
+ *      jit         functions/sec for compiling the generated modules to native code
+ *      eval        calls/sec of JIT compiled kernels under each fast-math policy, and
+ *                  iterations/sec of a tail recursive definition, and values/sec of a
+ *                  math function evaluated per call and as a batch, and calls/sec of a
+ *                  recursive definition compiled generic, specialized for an int argument,
+ *                  instrumented and re-optimized, and of a definition calling another one
+ *                  compiled generic and re-optimized
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <llvm/Support/TargetSelect.h>
+
+#include "Parser.hpp"
+#include "Reoptimizer.hpp"
+#include "Scanner.hpp"
+#include "CorpusGenerator.hpp"
+
+static ExitOnError ExitOnErr;
+
+struct BenchmarkOptions {
+    std::string label = "unlabeled";
+    std::string output;
+    int repeat = 3;
+    size_t scale = 1;
+    size_t evalCalls = 10000000;
+};
+
+struct BenchmarkResult {
+    std::string benchmark;
+    std::string corpus;
+    std::string unit;
+    size_t items;
+    double seconds;
+};
+
+static std::vector<BenchmarkResult> results;
+
+/** @brief Run `body` options.repeat times and record the fastest run
+ *  @param body runs the benchmark once and returns the seconds spent in the measured part
+ */
+static void runBenchmark(const BenchmarkOptions &options, const std::string &benchmark,
+                         const std::string &corpus, const std::string &unit, size_t items,
+                         const std::function<double()> &body) {
+    double best = 0;
+    for (int i = 0; i < options.repeat; i++) {
+        double seconds = body();
+        if (i == 0 || seconds < best) {
+            best = seconds;
+        }
+    }
+    results.push_back({benchmark, corpus, unit, items, best});
+
+    fprintf(stderr, "%-8s %-20s %12zu %-9s %10.4f s %14.0f %s/s\n", benchmark.c_str(),
+            corpus.c_str(), items, unit.c_str(), best, items / best, unit.c_str());
+}
+
+template <typename Body>
+static double timeSeconds(Body body) {
+    auto start = std::chrono::steady_clock::now();
+    body();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/** @brief Throw away the JIT and every function seen so far
+ */
+static void resetCompiler() {
+    FunctionProtos.clear();
+    FunctionDefinitions.clear();
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    initializeModule();
+}
+
+/** @brief Point the scanner at an in memory source and read the first token
+ */
+static FILE *openSource(const std::string &source) {
+    FILE *input = fmemopen((void *)source.data(), source.size(), "r");
+    if (!input) {
+        perror("fmemopen");
+        exit(1);
+    }
+    setScannerInput(input);
+    getNextToken();
+    return input;
+}
+
+static void closeSource(FILE *input) {
+    setScannerInput(stdin);
+    fclose(input);
+}
+
+static size_t scanCorpus(const Corpus &corpus) {
+    FILE *input = openSource(corpus.source);
+    size_t tokens = 1;
+    while (currToken != token_eof) {
+        getNextToken();
+        tokens++;
+    }
+    closeSource(input);
+    return tokens;
+}
+
+static std::vector<std::unique_ptr<ASTFunctionExpr>> parseCorpus(const Corpus &corpus) {
+    std::vector<std::unique_ptr<ASTFunctionExpr>> definitions;
+    FILE *input = openSource(corpus.source);
+    while (currToken != token_eof) {
+        if (currToken == token_def) {
+            if (auto definition = parseDefinition()) {
+                definitions.push_back(std::move(definition));
+                continue;
+            }
+        } else if (currToken == token_extern) {
+            if (auto externProto = parseExtern()) {
+                FunctionProtos[externProto->getName()] = std::move(externProto);
+                continue;
+            }
+        }
+        // Skip ';' and tokens of anything that failed to parse
+        getNextToken();
+    }
+    closeSource(input);
+
+    if (definitions.size() != corpus.functions) {
+        std::cerr << "Parsed " << definitions.size() << " of " << corpus.functions
+                  << " definitions in the " << corpus.name << " corpus" << std::endl;
+        exit(1);
+    }
+    return definitions;
+}
+
+/** @brief Generate one module per definition, like the interpreter does
+ */
+static std::vector<ThreadSafeModule>
+codegenDefinitions(std::vector<std::unique_ptr<ASTFunctionExpr>> &definitions,
+                   std::vector<std::string> &names) {
+    std::vector<ThreadSafeModule> modules;
+    for (auto &definition : definitions) {
+        Function *func = definition->codegen();
+        if (!func) {
+            std::cerr << "Code generation failed" << std::endl;
+            exit(1);
+        }
+        names.push_back(func->getName().str());
+        modules.emplace_back(std::move(TheModule), std::move(TheContext));
+        initializeModule();
+    }
+    return modules;
+}
+
+static void benchmarkCorpus(const BenchmarkOptions &options, const Corpus &corpus) {
+    size_t tokens = scanCorpus(corpus);
+    runBenchmark(options, "scan", corpus.name, "tokens", tokens, [&]() {
+        return timeSeconds([&]() { scanCorpus(corpus); });
+    });
+
+    runBenchmark(options, "parse", corpus.name, "nodes", corpus.nodes, [&]() {
+        return timeSeconds([&]() { parseCorpus(corpus); });
+    });
+
+    runBenchmark(options, "codegen", corpus.name, "functions", corpus.functions, [&]() {
+        auto definitions = parseCorpus(corpus);
+        resetCompiler();
+        std::vector<std::string> names;
+        return timeSeconds([&]() { codegenDefinitions(definitions, names); });
+    });
+
+    runBenchmark(options, "jit", corpus.name, "functions", corpus.functions, [&]() {
+        auto definitions = parseCorpus(corpus);
+        resetCompiler();
+        std::vector<std::string> names;
+        auto modules = codegenDefinitions(definitions, names);
+        return timeSeconds([&]() {
+            for (auto &module : modules) {
+                ExitOnErr(TheJIT->addModule(std::move(module)));
+            }
+            // Modules are compiled lazily, looking the functions up forces compilation
+            for (auto &name : names) {
+                ExitOnErr(TheJIT->lookup(name));
+            }
+        });
+    });
+}
+
+/** @brief Compile `source`, which has to define `name`, and return its address
+ */
+static JITTargetAddress compileFunction(const std::string &source, const std::string &name) {
+    Corpus corpus;
+    corpus.name = name;
+    corpus.source = source;
+    corpus.functions = 1;
+    for (auto &definition : parseCorpus(corpus)) {
+        if (!definition->codegen()) {
+            std::cerr << "Code generation failed" << std::endl;
+            exit(1);
+        }
+        ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+        initializeModule();
+        // Later definitions may call variants of it specialized for int arguments
+        FunctionDefinitions[definition->getName()] = std::move(definition);
+    }
+    return ExitOnErr(TheJIT->lookup(name)).getAddress();
+}
+
+/** @brief Compile `source` with tiered compilation and return the address of `name`, the stub
+ *  calling the instrumented or re-optimized definition
+ */
+static JITTargetAddress compileTiered(Reoptimizer &reoptimizer, const std::string &source,
+                                      const std::string &name) {
+    Corpus corpus;
+    corpus.name = name;
+    corpus.source = source;
+    corpus.functions = 1;
+    std::lock_guard<std::mutex> lock(CompilerMutex);
+    for (auto &definition : parseCorpus(corpus)) {
+        std::string definitionName = definition->getName();
+        Function *func = definition->codegen();
+        if (!func) {
+            std::cerr << "Code generation failed" << std::endl;
+            exit(1);
+        }
+        reoptimizer.instrument(func);
+        ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+        initializeModule();
+        FunctionDefinitions[definitionName] = std::move(definition);
+        ExitOnErr(reoptimizer.publish(definitionName));
+    }
+    return ExitOnErr(TheJIT->lookup(name)).getAddress();
+}
+
+/** @brief Measure calls/sec of the same kernels compiled under every fast-math policy
+ * Every call takes the result of the previous one, so the latency of the kernel is measured.
+ */
+static void benchmarkEval(const BenchmarkOptions &options) {
+    for (const char *policy : {"strict", "contract", "reassoc", "fast"}) {
+        resetCompiler();
+        std::string annotation = std::string("def [") + policy + "] ";
+
+        auto kernel = (double (*)(double, double))compileFunction(
+            annotation + "kernel(a b) a*a + 2*a*b + b*b;", "kernel");
+        runBenchmark(options, "eval", std::string("kernel-") + policy, "calls",
+                     options.evalCalls, [&]() {
+            volatile double sink = 0;
+            double seconds = timeSeconds([&]() {
+                double a = 0;
+                for (size_t i = 0; i < options.evalCalls; i++) {
+                    a = kernel(a * 1e-3, 0.5);
+                }
+                sink = a;
+            });
+            (void)sink;
+            return seconds;
+        });
+
+        // Horner's scheme is a chain of multiply-adds that contract into FMAs
+        auto poly = (double (*)(double))compileFunction(
+            annotation + "poly(x) (((((((x*0.1 + 0.2)*x + 0.3)*x + 0.4)*x + 0.5)*x + 0.6)*x"
+                         " + 0.7)*x + 0.8)*x + 0.9;",
+            "poly");
+        runBenchmark(options, "eval", std::string("poly-") + policy, "calls",
+                     options.evalCalls, [&]() {
+            volatile double sink = 0;
+            double seconds = timeSeconds([&]() {
+                double x = 0;
+                for (size_t i = 0; i < options.evalCalls; i++) {
+                    x = poly(x * 1e-3);
+                }
+                sink = x;
+            });
+            (void)sink;
+            return seconds;
+        });
+    }
+}
+
+/** @brief Measure iterations/sec of a tail recursive definition, which runs as a loop
+ */
+static void benchmarkTailRecursion(const BenchmarkOptions &options) {
+    resetCompiler();
+    auto count = (double (*)(double, double))compileFunction(
+        "def count(n acc) if n < 1 then acc else count(n - 1, acc + 1);", "count");
+
+    runBenchmark(options, "eval", "tail-recursion", "iterations", options.evalCalls, [&]() {
+        volatile double sink = 0;
+        double seconds = timeSeconds([&]() { sink = count((double)options.evalCalls, 0); });
+        (void)sink;
+        return seconds;
+    });
+
+    // Called with int literals, the driver runs the variant of count specialized for ints
+    auto driver = (double (*)())compileFunction(
+        "def driver() count(" + std::to_string(options.evalCalls) + ", 0);", "driver");
+    runBenchmark(options, "eval", "tail-recursion-int", "iterations", options.evalCalls, [&]() {
+        volatile double sink = 0;
+        double seconds = timeSeconds([&]() { sink = driver(); });
+        (void)sink;
+        return seconds;
+    });
+}
+
+/** @brief Compare calls/sec of fib(25) compiled as the generic function, specialized for an
+ *  int argument, with profiling instrumentation, and re-optimized once its profile showed it
+ *  is hot, and of smooth(x), which calls lerp, generic and re-optimized with lerp inlined
+ */
+static void benchmarkReoptimization(const BenchmarkOptions &options) {
+    const std::string source = "def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);";
+    // fib(25) makes 150049 calls
+    const size_t evaluations = std::max<size_t>(1, options.evalCalls / 150049);
+    auto measure = [&](const std::string &name, const std::function<double(double)> &fib) {
+        runBenchmark(options, "eval", name, "calls", evaluations * 150049, [&]() {
+            volatile double sink = 0;
+            double seconds = timeSeconds([&]() {
+                for (size_t i = 0; i < evaluations; i++) {
+                    sink = fib(25);
+                }
+            });
+            (void)sink;
+            return seconds;
+        });
+    };
+
+    resetCompiler();
+    measure("fib-generic", (double (*)(double))compileFunction(source, "fib"));
+
+    // Called with an int literal, the driver runs fib.i
+    auto driver = (double (*)())compileFunction("def driver() fib(25);", "driver");
+    measure("fib-int", [driver](double) { return driver(); });
+
+    {
+        resetCompiler();
+        ReoptimizerOptions reoptimizerOptions;
+        reoptimizerOptions.hotThreshold = UINT64_MAX;
+        Reoptimizer reoptimizer(*TheJIT, reoptimizerOptions);
+        measure("fib-instrumented", (double (*)(double))compileTiered(reoptimizer, source, "fib"));
+    }
+
+    {
+        resetCompiler();
+        ReoptimizerOptions reoptimizerOptions;
+        reoptimizerOptions.hotThreshold = 1000;
+        Reoptimizer reoptimizer(*TheJIT, reoptimizerOptions);
+        auto fib = (double (*)(double))compileTiered(reoptimizer, source, "fib");
+        // Warm up until the stub calls the re-optimized code
+        fib(25);
+        reoptimizer.waitUntilIdle();
+        measure("fib-reoptimized", fib);
+    }
+
+    // Generic code calls other definitions through the JIT, re-optimized code inlines them
+    const std::string lerp = "def lerp(a b t) a + (b - a)*t;";
+    const std::string smooth = "def smooth(x) lerp(lerp(x, 1.5, 0.25), lerp(x, 2.5, 0.5), 0.75);";
+    auto measureSmooth = [&](const std::string &name, double (*smooth)(double)) {
+        runBenchmark(options, "eval", name, "calls", options.evalCalls, [&]() {
+            volatile double sink = 0;
+            // Independent calls, so the cost of calling is not hidden behind the latency of
+            // the previous result
+            double seconds = timeSeconds([&]() {
+                double sum = 0;
+                for (size_t i = 0; i < options.evalCalls; i++) {
+                    sum += smooth((i & 1023) * 1e-3);
+                }
+                sink = sum;
+            });
+            (void)sink;
+            return seconds;
+        });
+    };
+
+    resetCompiler();
+    compileFunction(lerp, "lerp");
+    measureSmooth("helpers-generic", (double (*)(double))compileFunction(smooth, "smooth"));
+
+    {
+        resetCompiler();
+        ReoptimizerOptions reoptimizerOptions;
+        reoptimizerOptions.hotThreshold = 1000;
+        Reoptimizer reoptimizer(*TheJIT, reoptimizerOptions);
+        compileTiered(reoptimizer, lerp, "lerp");
+        auto tiered = (double (*)(double))compileTiered(reoptimizer, smooth, "smooth");
+        // Warm up until the stub calls the re-optimized code
+        for (int i = 0; i < 1000; i++) {
+            tiered(i * 1e-3);
+        }
+        reoptimizer.waitUntilIdle();
+        measureSmooth("helpers-reoptimized", tiered);
+    }
+}
+
+/** @brief Compare evaluating a math heavy function one call at a time against its batch
+ *  function, which runs the same computation as SIMD code calling libmvec
+ */
+static void benchmarkBatch(const BenchmarkOptions &options) {
+    resetCompiler();
+    const std::string source = "extern sin(x); extern cos(x); extern sqrt(x);"
+                               "def wave(x) sin(x) * cos(x) + sqrt(x);";
+
+    auto wave = (double (*)(double))compileFunction(source, "wave");
+
+    auto definitions = parseCorpus({"wave", source, 1, 0});
+    if (!definitions[0]->codegenBatch()) {
+        std::cerr << "Batch code generation failed" << std::endl;
+        exit(1);
+    }
+    ExitOnErr(TheJIT->addModule(ThreadSafeModule(std::move(TheModule), std::move(TheContext))));
+    initializeModule();
+    auto waveBatch = (void (*)(double *, double *, int64_t))ExitOnErr(
+        TheJIT->lookup("wave.batch")).getAddress();
+
+    const size_t count = 4096;
+    std::vector<double> arguments(count), results(count);
+    for (size_t i = 0; i < count; i++) {
+        arguments[i] = i * 0.001;
+    }
+    size_t rounds = std::max<size_t>(1, options.evalCalls / count);
+
+    // libmvec is accurate to a few ulp, make sure the batch computes the same function
+    std::vector<double> batchResults(count);
+    waveBatch(batchResults.data(), arguments.data(), count);
+    for (size_t i = 0; i < count; i++) {
+        double expected = wave(arguments[i]);
+        if (std::abs(batchResults[i] - expected) > 1e-12 * std::max(1.0, std::abs(expected))) {
+            std::cerr << "wave.batch(" << arguments[i] << ") = " << batchResults[i]
+                      << ", expected " << expected << std::endl;
+            exit(1);
+        }
+    }
+
+    runBenchmark(options, "eval", "wave-scalar", "values", rounds * count, [&]() {
+        return timeSeconds([&]() {
+            for (size_t round = 0; round < rounds; round++) {
+                for (size_t i = 0; i < count; i++) {
+                    results[i] = wave(arguments[i]);
+                }
+            }
+        });
+    });
+
+    runBenchmark(options, "eval", "wave-batch", "values", rounds * count, [&]() {
+        return timeSeconds([&]() {
+            for (size_t round = 0; round < rounds; round++) {
+                waveBatch(results.data(), arguments.data(), count);
+            }
+        });
+    });
+}
+
+static void writeResults(const BenchmarkOptions &options) {
+    std::ostringstream json;
+    json << "{\n  \"label\": \"" << options.label << "\",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &result = results[i];
+        json << "    {\"benchmark\": \"" << result.benchmark << "\", \"corpus\": \""
+             << result.corpus << "\", \"unit\": \"" << result.unit << "\", \"items\": "
+             << result.items << ", \"seconds\": " << result.seconds
+             << ", \"items_per_second\": " << result.items / result.seconds << "}"
+             << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+
+    if (options.output.empty()) {
+        std::cout << json.str();
+        return;
+    }
+    std::ofstream out(options.output);
+    out << json.str();
+    if (!out) {
+        std::cerr << "Unable to write " << options.output << std::endl;
+        exit(1);
+    }
+}
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [--label <name>] [--output <file>] [--repeat <n>] [--scale <n>]"
+                 " [--eval-calls <n>]"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--label") == 0 && hasValue) {
+            options.label = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && hasValue) {
+            options.output = argv[++i];
+        } else if (strcmp(argv[i], "--repeat") == 0 && hasValue) {
+            options.repeat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--scale") == 0 && hasValue) {
+            options.scale = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--eval-calls") == 0 && hasValue) {
+            options.evalCalls = strtoul(argv[++i], nullptr, 10);
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.repeat < 1 || options.scale < 1) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    setOperatorPrecedence();
+    setupParser();
+
+    benchmarkCorpus(options, generateDeepCorpus(50 * options.scale, 200));
+    benchmarkCorpus(options, generateWideCorpus(500 * options.scale, 8));
+    benchmarkCorpus(options, generateDefsCorpus(1000 * options.scale));
+    benchmarkEval(options);
+    benchmarkTailRecursion(options);
+    benchmarkBatch(options);
+    benchmarkReoptimization(options);
+
+    writeResults(options);
+    return 0;
+}
@@ -0,0 +1,103 @@
+
+#include <random>
+#include <sstream>
+
+#include "CorpusGenerator.hpp"
+
+static const char binaryOperators[] = {'+', '-', '*', '<'};
+
+/** @brief Append a variable or a number literal
+ */
+static void generateLeaf(std::ostringstream &out, std::mt19937 &rng, Corpus &corpus) {
+    if (rng() % 2) {
+        out << (rng() % 2 ? "a" : "b");
+    } else {
+        out << (rng() % 100) << "." << (rng() % 10);
+    }
+    corpus.nodes++;
+}
+
+/** @brief Append a binary expression chain nested `depth` levels deep
+ * Only one side of every operator recurses, so the size grows linearly with the depth.
+ */
+static void generateDeepExpr(std::ostringstream &out, std::mt19937 &rng, Corpus &corpus,
+                             size_t depth) {
+    if (depth == 0) {
+        generateLeaf(out, rng, corpus);
+        return;
+    }
+
+    char op = binaryOperators[rng() % sizeof(binaryOperators)];
+    out << "(";
+    if (rng() % 2) {
+        generateDeepExpr(out, rng, corpus, depth - 1);
+        out << " " << op << " ";
+        generateLeaf(out, rng, corpus);
+    } else {
+        generateLeaf(out, rng, corpus);
+        out << " " << op << " ";
+        generateDeepExpr(out, rng, corpus, depth - 1);
+    }
+    out << ")";
+    corpus.nodes++;
+}
+
+Corpus generateDeepCorpus(size_t functions, size_t depth, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::ostringstream out;
+    Corpus corpus;
+    corpus.name = "deep";
+
+    for (size_t i = 0; i < functions; i++) {
+        out << "def deep" << i << "(a b) ";
+        generateDeepExpr(out, rng, corpus, depth);
+        out << ";\n";
+        corpus.nodes += 2;
+        corpus.functions++;
+    }
+
+    corpus.source = out.str();
+    return corpus;
+}
+
+Corpus generateWideCorpus(size_t functions, size_t fanOut, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::ostringstream out;
+    Corpus corpus;
+    corpus.name = "wide";
+
+    for (size_t i = 0; i < functions; i++) {
+        out << "def wide" << i << "(a b) a * b";
+        corpus.nodes += 3;
+        // The first function has nobody to call
+        for (size_t call = 0; i > 0 && call < fanOut; call++) {
+            out << " + wide" << (rng() % i) << "(b, a + " << (rng() % 10) << ")";
+            // BinaryExpr(+), CallExpr, Variable, BinaryExpr(+), Variable, Number
+            corpus.nodes += 6;
+        }
+        out << ";\n";
+        corpus.nodes += 2;
+        corpus.functions++;
+    }
+
+    corpus.source = out.str();
+    return corpus;
+}
+
+Corpus generateDefsCorpus(size_t functions, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::ostringstream out;
+    Corpus corpus;
+    corpus.name = "defs";
+
+    for (size_t i = 0; i < functions; i++) {
+        out << "def small" << i << "(a b) ";
+        generateDeepExpr(out, rng, corpus, 1 + rng() % 4);
+        out << ";\n";
+        corpus.nodes += 2;
+        corpus.functions++;
+    }
+
+    corpus.source = out.str();
+    return corpus;
+}
@@ -0,0 +1,38 @@
+/*
+ **************************************** Corpus Generator ****************************************
+ * Generates large synthetic Kaleidoscope programs for the benchmarks
+ * Every corpus is deterministic for a given seed so results are comparable between commits.
+ *
+ *      deep    functions whose bodies are deeply nested expressions
+ *      wide    a call graph where every function calls several earlier functions
+ *      defs    thousands of small definitions
+ */
+
+#ifndef CORPUS_GENERATOR_H_
+#define CORPUS_GENERATOR_H_
+
+#include <cstddef>
+#include <string>
+
+struct Corpus {
+    std::string name;
+    std::string source;
+    // Number of function definitions in the corpus
+    size_t functions = 0;
+    // Number of AST nodes the parser creates, a definition counts as FunctionExpr + ProtoExpr
+    size_t nodes = 0;
+};
+
+/** @brief Generate functions whose bodies are expressions nested `depth` levels deep
+ */
+Corpus generateDeepCorpus(size_t functions, size_t depth, unsigned seed = 1);
+
+/** @brief Generate functions that each call `fanOut` randomly chosen earlier functions
+ */
+Corpus generateWideCorpus(size_t functions, size_t fanOut, unsigned seed = 1);
+
+/** @brief Generate many small independent definitions
+ */
+Corpus generateDefsCorpus(size_t functions, unsigned seed = 1);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Writes a synthetic Kaleidoscope corpus to standard output, e.g.
+ *      ./gencorpus wide 2000 8 > wide.ka
+ *      ./interpreter < wide.ka
+ */
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "CorpusGenerator.hpp"
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program << " deep <functions> <depth> [seed]" << std::endl;
+    std::cerr << "       " << program << " wide <functions> <fan out> [seed]" << std::endl;
+    std::cerr << "       " << program << " defs <functions> [seed]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const char *kind = argv[1];
+    size_t functions = strtoul(argv[2], nullptr, 10);
+    Corpus corpus;
+
+    if (strcmp(kind, "deep") == 0 || strcmp(kind, "wide") == 0) {
+        if (argc < 4) {
+            printUsage(argv[0]);
+            return 1;
+        }
+        size_t shape = strtoul(argv[3], nullptr, 10);
+        unsigned seed = argc > 4 ? strtoul(argv[4], nullptr, 10) : 1;
+        corpus = strcmp(kind, "deep") == 0 ? generateDeepCorpus(functions, shape, seed)
+                                           : generateWideCorpus(functions, shape, seed);
+    } else if (strcmp(kind, "defs") == 0) {
+        unsigned seed = argc > 3 ? strtoul(argv[3], nullptr, 10) : 1;
+        corpus = generateDefsCorpus(functions, seed);
+    } else {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::cout << "# " << corpus.name << " corpus: " << corpus.functions << " functions, "
+              << corpus.nodes << " AST nodes" << std::endl;
+    std::cout << corpus.source;
+    return 0;
+}
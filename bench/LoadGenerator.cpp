@@ -0,0 +1,267 @@
+/*
+ * Load generator for the evaluation server (interpreter --serve=<socket>)
+ *
+ *      ./interpreter --serve=/tmp/kaleidoscope.sock &
+ *      ./loadgen --socket /tmp/kaleidoscope.sock --connections 8 --requests 20000
+ *
+ * Sends the --define statements once (fib by default), then sends --expression (fib(20) by
+ * default) --requests times in total over --connections connections. Every connection
+ * waits for the response to a request before sending the next one, so the number of
+ * connections is the number of requests in flight. The server keeps repeated expressions
+ * compiled; {n} in the expression is replaced by a number unique to every request (also
+ * across runs), which makes the server compile every request, e.g. "fib(20) + {n}".
+ *
+ * Reports the throughput and the p50/p99 latency, both as seen by the client and as
+ * measured by the server (which excludes the time spent in the socket and in the client).
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct LoadOptions {
+    std::string socketPath = "/tmp/kaleidoscope.sock";
+    size_t connections = 8;
+    size_t requests = 10000;
+    std::vector<std::string> definitions;
+    std::string expression = "fib(20)";
+};
+
+/* Latencies in microseconds of the requests sent over one connection */
+struct ConnectionResult {
+    std::vector<double> clientLatencies;
+    std::vector<double> serverLatencies;
+    size_t errors = 0;
+    std::string lastError;
+};
+
+class Connection {
+    int socketFd = -1;
+    std::string buffer;
+
+public:
+    ~Connection() {
+        if (socketFd >= 0) {
+            close(socketFd);
+        }
+    }
+
+    bool open(const std::string &path) {
+        socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (socketFd < 0) {
+            return false;
+        }
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        return connect(socketFd, (sockaddr *)&address, sizeof(address)) == 0;
+    }
+
+    /** @brief Send one statement and wait for its response line
+     *  @return false if the connection failed
+     */
+    bool request(const std::string &statement, std::string &response) {
+        std::string line = statement + "\n";
+        size_t sent = 0;
+        while (sent < line.size()) {
+            ssize_t count = send(socketFd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0) {
+                return false;
+            }
+            sent += count;
+        }
+
+        size_t newline;
+        char chunk[4096];
+        while ((newline = buffer.find('\n')) == std::string::npos) {
+            ssize_t count = recv(socketFd, chunk, sizeof(chunk), 0);
+            if (count <= 0) {
+                return false;
+            }
+            buffer.append(chunk, count);
+        }
+        response = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        return true;
+    }
+};
+
+/** @brief Split a response "<status> <latency> <payload>" into its fields
+ */
+static bool parseResponse(const std::string &response, bool &ok, double &latency,
+                          std::string &payload) {
+    size_t statusEnd = response.find(' ');
+    if (statusEnd == std::string::npos) {
+        return false;
+    }
+    ok = response.compare(0, statusEnd, "ok") == 0;
+    char *latencyEnd;
+    latency = strtod(response.c_str() + statusEnd + 1, &latencyEnd);
+    payload = *latencyEnd == ' ' ? std::string(latencyEnd + 1) : std::string();
+    return latencyEnd != response.c_str() + statusEnd + 1;
+}
+
+/** @brief Replace every {n} in the expression with `n`
+ */
+static std::string instantiate(const std::string &expression, size_t n) {
+    std::string statement = expression;
+    size_t position;
+    while ((position = statement.find("{n}")) != std::string::npos) {
+        statement.replace(position, 3, std::to_string(n));
+    }
+    return statement;
+}
+
+/** @brief Send `requests` requests numbered from `first`
+ */
+static void runConnection(const LoadOptions &options, size_t first, size_t requests,
+                          ConnectionResult &result) {
+    Connection connection;
+    if (!connection.open(options.socketPath)) {
+        perror(options.socketPath.c_str());
+        exit(1);
+    }
+
+    std::string response;
+    for (size_t i = 0; i < requests; i++) {
+        auto start = std::chrono::steady_clock::now();
+        if (!connection.request(instantiate(options.expression, first + i), response)) {
+            std::cerr << "Connection to the server lost" << std::endl;
+            exit(1);
+        }
+        std::chrono::duration<double, std::micro> latency =
+            std::chrono::steady_clock::now() - start;
+
+        bool ok;
+        double serverLatency;
+        std::string payload;
+        if (!parseResponse(response, ok, serverLatency, payload)) {
+            std::cerr << "Malformed response: " << response << std::endl;
+            exit(1);
+        }
+        if (!ok) {
+            result.errors++;
+            result.lastError = payload;
+        }
+        result.clientLatencies.push_back(latency.count());
+        result.serverLatencies.push_back(serverLatency);
+    }
+}
+
+/** @brief Percentile of sorted latencies, by the nearest rank
+ */
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = (size_t)(fraction * sorted.size() + 0.5);
+    return sorted[std::min(sorted.size() - 1, rank > 0 ? rank - 1 : 0)];
+}
+
+static void printLatencies(const char *name, std::vector<double> &latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    printf("%-8s %12.1f %12.1f %12.1f\n", name, percentile(latencies, 0.5),
+           percentile(latencies, 0.99), latencies.empty() ? 0 : latencies.back());
+}
+
+static void printUsage(const char *program) {
+    std::cerr << "Usage: " << program
+              << " [--socket <path>] [--connections <n>] [--requests <n>]"
+                 " [--define <statement>]... [--expression <statement>]"
+              << std::endl;
+}
+
+int main(int argc, char **argv) {
+    LoadOptions options;
+    for (int i = 1; i < argc; i++) {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--socket") == 0 && hasValue) {
+            options.socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--connections") == 0 && hasValue) {
+            options.connections = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--requests") == 0 && hasValue) {
+            options.requests = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--define") == 0 && hasValue) {
+            options.definitions.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--expression") == 0 && hasValue) {
+            options.expression = argv[++i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.connections < 1 || options.requests < options.connections) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (options.definitions.empty()) {
+        options.definitions.push_back("def fib(x) if x < 3 then 1 else fib(x-1) + fib(x-2)");
+    }
+
+    Connection setup;
+    if (!setup.open(options.socketPath)) {
+        perror(options.socketPath.c_str());
+        return 1;
+    }
+    for (auto &definition : options.definitions) {
+        std::string response;
+        if (!setup.request(definition, response)) {
+            std::cerr << "Connection to the server lost" << std::endl;
+            return 1;
+        }
+        // A server that is still running from a previous run already has the definitions
+        if (response.compare(0, 3, "ok ") != 0) {
+            std::cerr << definition << ": " << response << std::endl;
+        }
+    }
+
+    std::vector<ConnectionResult> results(options.connections);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    // A running server keeps the expressions of earlier runs compiled
+    size_t first = (size_t)getpid() * options.requests;
+    for (size_t i = 0; i < options.connections; i++) {
+        // Spread the requests evenly, the first connections take the remainder
+        size_t requests = options.requests / options.connections +
+                          (i < options.requests % options.connections ? 1 : 0);
+        threads.emplace_back(runConnection, std::cref(options), first, requests,
+                             std::ref(results[i]));
+        first += requests;
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    ConnectionResult total;
+    for (auto &result : results) {
+        total.clientLatencies.insert(total.clientLatencies.end(), result.clientLatencies.begin(),
+                                     result.clientLatencies.end());
+        total.serverLatencies.insert(total.serverLatencies.end(), result.serverLatencies.begin(),
+                                     result.serverLatencies.end());
+        total.errors += result.errors;
+        if (!result.lastError.empty()) {
+            total.lastError = result.lastError;
+        }
+    }
+
+    printf("%zu requests over %zu connections in %.3f s: %.0f requests/s, %zu errors\n",
+           options.requests, options.connections, elapsed.count(),
+           options.requests / elapsed.count(), total.errors);
+    printf("%-8s %12s %12s %12s\n", "latency", "p50 (us)", "p99 (us)", "max (us)");
+    printLatencies("client", total.clientLatencies);
+    printLatencies("server", total.serverLatencies);
+    if (total.errors) {
+        std::cerr << "Last error: " << total.lastError << std::endl;
+        return 1;
+    }
+    return 0;
+}